@@ -4,6 +4,18 @@
 #include <algorithm>
 #include <string>
 #include <climits>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include "RedBlackTree.h"
 
 /*   Sources I used: 
@@ -39,33 +51,83 @@ RedBlackTree::RedBlackTree(int newData) : numItems(1){   // empty destructor
 RedBlackTree::RedBlackTree(const RedBlackTree& rbt){
     root=CopyOf(rbt.root);   //  copy root and numItems
     numItems=rbt.numItems;
+    writeBufferLimit=rbt.writeBufferLimit;   //  keys still waiting in the buffer belong to the copy too
+    writeBuffer=rbt.writeBuffer;
+    writeBufferMin=rbt.writeBufferMin;
+    writeBufferMax=rbt.writeBufferMax;
+    filterBitsPerKey=rbt.filterBitsPerKey;
+    filterHashes=rbt.filterHashes;
+    filterCapacity=rbt.filterCapacity;
+    filterBlocks=rbt.filterBlocks;
 }
 
 RedBlackTree::~RedBlackTree(){  // destructor
+    if (logFd!=-1 && !logFailed){
+        try{
+            FlushLog();   // don't lose a partially filled group
+        }
+        catch (const runtime_error &e){   // can't throw out of a destructor, call FlushLog() first to see this
+            cerr << "RedBlackTree: last log group lost: " << e.what() << endl;
+        }
+        close(logFd);
+    }
     del(root);
+    delete[] arena;
 }
 
 void RedBlackTree::del(RBTNode* node){
     if (node!=nullptr){
         del(node->left);  // recur across left subtrees
         del(node->right);   // recur across right subtrees
-        delete node;   // deallocate each node
+        if (!node->InArena){   // compacted nodes go away with the whole block
+            delete node;   // deallocate each node
+        }
     }
 }
 
 void RedBlackTree::Insert(int newData){
+    if (logFd!=-1){
+        AppendLog(LOG_OP_INSERT, newData);  // write ahead, before the tree changes
+    }
+    numItems++;  // number of nodes increases by 1
+    if (writeBufferLimit>0){
+        if (writeBuffer.empty() || newData<writeBufferMin){
+            writeBufferMin=newData;
+        }
+        if (writeBuffer.empty() || newData>writeBufferMax){
+            writeBufferMax=newData;
+        }
+        writeBuffer.push_back(newData);  // sorted once, when it's flushed
+        if (writeBuffer.size()>writeBufferLimit){
+            FlushWriteBuffer();
+        }
+    }
+    else{
+        InsertIntoTree(newData);
+    }
+    if (filterBitsPerKey>0){
+        if (numItems>filterCapacity){   // too full to stay accurate, size it for the new count
+            RebuildFilter();
+        }
+        else{
+            FilterAdd(newData);
+        }
+    }
+}
+
+RBTNode *RedBlackTree::InsertIntoTree(int newData, RBTNode *from){
     RBTNode *node=new RBTNode;  // create new RBTNode and assign value
     node->data=newData;
-    BasicInsert(node);   //  //follow the binary search tree to add the node as the leaf node
+    BasicInsert(node, from);   //  //follow the binary search tree to add the node as the leaf node
     if(node->parent!=nullptr && node->parent->color==COLOR_RED){
         InsertFixUp(node);  
     }
-    numItems++;  // number of nodes increases by 1
+    return node;
 }
 
-void RedBlackTree::BasicInsert(RBTNode *NewNode){
+void RedBlackTree::BasicInsert(RBTNode *NewNode, RBTNode *from){
     RBTNode *y=nullptr;
-    RBTNode *x=root;
+    RBTNode *x=(from!=nullptr) ? from : root;   // from must be a subtree whose key range holds the new key
     while (x!=nullptr){
         y=x;
         if (NewNode->data<x->data){  // if our node's value is lesser, go to left child until you reach a leaf
@@ -88,6 +150,9 @@ void RedBlackTree::BasicInsert(RBTNode *NewNode){
     NewNode->left=nullptr;            
     NewNode->right=nullptr;
     NewNode->color=COLOR_RED;
+    for (RBTNode *a=NewNode; a!=nullptr; a=a->parent){   // every ancestor's subtree just gained a key
+        UpdateAggregate(a);
+    }
     root->color=COLOR_BLACK;   // making sure that the root STAYS BLACK
 }
 
@@ -160,6 +225,7 @@ void RedBlackTree::LeftRotate(RBTNode *x){
     if (y->left!=nullptr){  
         y->left->parent=x;   //  update parent of left subtree of y to x
     }
+    y->parent=x->parent;   //  y takes x's place under x's old parent
     if (x->parent==nullptr){  // if x was a root, update root to y
         root=y;    
     }
@@ -171,6 +237,8 @@ void RedBlackTree::LeftRotate(RBTNode *x){
     }
     y->left=x;   //  finish rotation, x become's y's left child, making y its parent
     x->parent=y;
+    UpdateAggregate(x);   //  x is now below y, so fix x first
+    UpdateAggregate(y);
 }
 
 void RedBlackTree::RightRotate(RBTNode *x){
@@ -179,6 +247,7 @@ void RedBlackTree::RightRotate(RBTNode *x){
     if (y->right != nullptr){
         y->right->parent=x;   //  update parent of right subtree of y to x
     }
+    y->parent=x->parent;   //  y takes x's place under x's old parent
     if (x->parent==nullptr){  // if x was a root, update root to y
         root=y;
     }
@@ -190,27 +259,25 @@ void RedBlackTree::RightRotate(RBTNode *x){
     }
     y->right=x;   //  finish rotation, x become's y's right child, making y its parent
     x->parent=y;
+    UpdateAggregate(x);   //  x is now below y, so fix x first
+    UpdateAggregate(y);
 }
 
 
 bool RedBlackTree::Contains(int data) const {
-    return (Get(data)!=nullptr);  // if we didn't get a node equal to our value, it doesn't exist
+    if (filterBitsPerKey>0 && !FilterMayContain(data)){   // definite miss, skip the walk
+        return false;
+    }
+    if (Get(data)!=nullptr){
+        return true;
+    }
+    return find(writeBuffer.begin(), writeBuffer.end(), data)!=writeBuffer.end();  // it may not be merged yet
 }
 
 RBTNode *RedBlackTree::Get(int data) const{
-    RBTNode* x=root;  // start at root
-    while (x!=nullptr){
-        if (data==x->data){   // if data matches our node's value, return node
-            return x;
-        } 
-        else if (data<x->data){  // if data is less than our node's value, go to left child
-            x=x->left;
-        } 
-        else{
-            x=x->right;   // if data is more than our node's value, go to right child
-        }
-    }
-    return nullptr;  // otherwise node doesn't exist
+    return SearchTree<RBTNode *>(root, nullptr, data,   // start at root
+        [](RBTNode *x){ return x->data; },
+        [](RBTNode *x, bool goLeft){ return goLeft ? x->left : x->right; });
 }
 
 RBTNode* RedBlackTree::GetUncle(RBTNode *node){
@@ -230,23 +297,35 @@ RBTNode* RedBlackTree::GetUncle(RBTNode *node){
 
 int RedBlackTree::GetMin() const{
     if (root==nullptr){  // no node, no minimum
+        if (!writeBuffer.empty()){  // unless it's still in the buffer
+            return writeBufferMin;
+        }
         throw invalid_argument("No minimum exists");
     }
     RBTNode* x=root;
     while (x->left!=nullptr){  // keep going down left to get minimum
         x=x->left;
     }
+    if (!writeBuffer.empty() && writeBufferMin<x->data){
+        return writeBufferMin;
+    }
     return x->data;  // return lowest value
 }
 
 int RedBlackTree::GetMax() const{
     if (root==nullptr){  // no node, no maximum
+        if (!writeBuffer.empty()){  // unless it's still in the buffer
+            return writeBufferMax;
+        }
         throw invalid_argument("No maximum exists");
     }
     RBTNode* x=root;
     while (x->right!=nullptr){  // keep going down right to get maximum
         x=x->right;
     }
+    if (!writeBuffer.empty() && writeBufferMax>x->data){
+        return writeBufferMax;
+    }
     return x->data;  // return highest value
 }
 
@@ -331,6 +410,1181 @@ RBTNode *RedBlackTree::CopyOf(const RBTNode *node) {
     if (n->right!=nullptr){  // recursive call to copy each right node
         n->right->parent=n;   // and if it exists, add it to the copy tree
     }
+    UpdateAggregate(n);
     return n;
 }
 
+
+/*
+Write-ahead log
+
+Every mutation becomes a LOG_RECORD_SIZE byte record (op byte, sequence number,
+key). Records are buffered and handed to the kernel with one write() and one
+fdatasync() per group, so a crash loses at most the last unfinished group. A
+checkpoint is a small header with the last sequence number it covers, followed by
+the keys in sorted order as raw ints. Recovery rebuilds the tree from it in linear
+time and replays only the newer log records, so a crash between writing the
+checkpoint and truncating the log doesn't apply anything twice.
+*/
+
+static void WriteAll(int fd, const char *buf, size_t len){
+    while (len>0){
+        ssize_t written=write(fd, buf, len);
+        if (written<0){
+            if (errno==EINTR){  // interrupted, just try again
+                continue;
+            }
+            throw runtime_error(string("write failed: ")+strerror(errno));
+        }
+        buf+=written;
+        len-=written;
+    }
+}
+
+static size_t ReadFull(int fd, char *buf, size_t len){
+    size_t total=0;
+    while (total<len){
+        ssize_t got=read(fd, buf+total, len-total);
+        if (got<0){
+            if (errno==EINTR){
+                continue;
+            }
+            throw runtime_error(string("read failed: ")+strerror(errno));
+        }
+        if (got==0){  // end of file
+            break;
+        }
+        total+=got;
+    }
+    return total;
+}
+
+void RedBlackTree::EnableLog(const string &logPath, size_t groupCommitSize){
+    if (logFd!=-1){
+        throw invalid_argument("Log already enabled");
+    }
+    if (groupCommitSize==0){
+        throw invalid_argument("Group commit size must be at least 1");
+    }
+    logFd=open(logPath.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0644);
+    if (logFd==-1){
+        throw runtime_error("Cannot open log "+logPath+": "+strerror(errno));
+    }
+    logGroupSize=groupCommitSize;
+    logPending.reserve(logGroupSize*LOG_RECORD_SIZE);
+}
+
+void RedBlackTree::AppendLog(char op, int data){
+    if (logFailed){   // the mutation isn't applied either
+        throw runtime_error("Log failed earlier, no further changes are logged");
+    }
+    logPending.push_back(op);
+    logSequence++;
+    char sequence[sizeof(logSequence)];
+    memcpy(sequence, &logSequence, sizeof(logSequence));
+    logPending.insert(logPending.end(), sequence, sequence+sizeof(logSequence));
+    char key[sizeof(int)];
+    memcpy(key, &data, sizeof(int));
+    logPending.insert(logPending.end(), key, key+sizeof(int));
+    if (logPending.size()>=logGroupSize*LOG_RECORD_SIZE){  // group is full, commit it
+        FlushLog();
+    }
+}
+
+void RedBlackTree::FlushLog(){
+    if (logFailed){
+        throw runtime_error("Log failed earlier, no further changes are logged");
+    }
+    if (logFd==-1 || logPending.empty()){
+        return;
+    }
+    try{
+        WriteAll(logFd, logPending.data(), logPending.size());  // one write for the whole group
+        if (fdatasync(logFd)!=0){
+            throw runtime_error(string("fdatasync failed: ")+strerror(errno));
+        }
+    }
+    catch (...){   // part of the group may be on disk already, writing it again would repeat it
+        logFailed=true;
+        logPending.clear();
+        throw;
+    }
+    logPending.clear();
+}
+
+void RedBlackTree::WriteInOrder(const RBTNode *n, vector<int> &chunk, int fd){
+    if (n==nullptr){
+        return;
+    }
+    WriteInOrder(n->left, chunk, fd);
+    chunk.push_back(n->data);
+    if (chunk.size()==chunk.capacity()){  // write out in large sequential pieces
+        WriteAll(fd, (const char *)chunk.data(), chunk.size()*sizeof(int));
+        chunk.clear();
+    }
+    WriteInOrder(n->right, chunk, fd);
+}
+
+static void SyncParentDirectory(const string &path){
+    size_t slash=path.find_last_of('/');
+    string directory=(slash==string::npos) ? "." : (slash==0 ? "/" : path.substr(0, slash));
+    int fd=open(directory.c_str(), O_RDONLY|O_DIRECTORY);
+    if (fd==-1){
+        throw runtime_error("Cannot open directory "+directory+": "+strerror(errno));
+    }
+    if (fsync(fd)!=0){   // makes a rename in this directory durable
+        close(fd);
+        throw runtime_error(string("fsync failed: ")+strerror(errno));
+    }
+    close(fd);
+}
+
+void RedBlackTree::Checkpoint(const string &checkpointPath){
+    FlushLog();
+    FlushWriteBuffer();   // the snapshot is written from the tree alone
+    string tmpPath=checkpointPath+".tmp";   // write beside it, then rename so a crash never leaves half a snapshot
+    int fd=open(tmpPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd==-1){
+        throw runtime_error("Cannot open checkpoint "+tmpPath+": "+strerror(errno));
+    }
+    try{
+        unsigned long long header[2]={CHECKPOINT_MAGIC, logSequence};   // every record up to here is in the snapshot
+        WriteAll(fd, (const char *)header, CHECKPOINT_HEADER_SIZE);
+        vector<int> chunk;
+        chunk.reserve(1<<16);
+        WriteInOrder(root, chunk, fd);
+        WriteAll(fd, (const char *)chunk.data(), chunk.size()*sizeof(int));
+        if (fdatasync(fd)!=0){
+            throw runtime_error(string("fdatasync failed: ")+strerror(errno));
+        }
+    }
+    catch (...){   // the old snapshot is untouched, don't leave half a new one beside it
+        close(fd);
+        remove(tmpPath.c_str());
+        throw;
+    }
+    close(fd);
+    if (rename(tmpPath.c_str(), checkpointPath.c_str())!=0){
+        throw runtime_error(string("rename failed: ")+strerror(errno));
+    }
+    SyncParentDirectory(checkpointPath);   // the new snapshot has to be durable before the log goes
+    if (logFd!=-1 && ftruncate(logFd, 0)!=0){  // everything logged so far is in the snapshot now
+        throw runtime_error(string("ftruncate failed: ")+strerror(errno));
+    }
+}
+
+void RedBlackTree::Recover(const string &checkpointPath, const string &logPath){
+    if (root!=nullptr || logFd!=-1){
+        throw invalid_argument("Recover needs an empty tree without a log");
+    }
+    unsigned long long covered=0;
+    int fd=open(checkpointPath.c_str(), O_RDONLY);
+    if (fd!=-1){   // no checkpoint just means start from an empty tree
+        unsigned long long header[2];
+        size_t got;
+        try{
+            got=ReadFull(fd, (char *)header, CHECKPOINT_HEADER_SIZE);
+        }
+        catch (...){
+            close(fd);
+            throw;
+        }
+        close(fd);
+        if (got!=CHECKPOINT_HEADER_SIZE || header[0]!=CHECKPOINT_MAGIC){
+            throw runtime_error("Checkpoint "+checkpointPath+" has no valid header");
+        }
+        covered=header[1];
+        LoadSortedKeys(checkpointPath, CHECKPOINT_HEADER_SIZE);
+    }
+    logSequence=covered;
+    vector<char> chunk(1<<18);
+    fd=open(logPath.c_str(), O_RDWR);   // writable, a torn tail gets cut off below
+    if (fd==-1){
+        return;
+    }
+    size_t carry=0;
+    off_t total=0;
+    try{
+        while (true){
+            size_t got=ReadFull(fd, chunk.data()+carry, chunk.size()-carry);
+            total+=got;
+            size_t len=carry+got;
+            size_t pos=0;
+            for (; pos+LOG_RECORD_SIZE<=len; pos+=LOG_RECORD_SIZE){
+                unsigned long long sequence;
+                int key;
+                memcpy(&sequence, chunk.data()+pos+1, sizeof(sequence));
+                memcpy(&key, chunk.data()+pos+1+sizeof(sequence), sizeof(int));
+                if (chunk[pos]!=LOG_OP_INSERT){
+                    throw runtime_error("Unknown log record in "+logPath);
+                }
+                if (sequence>logSequence){   // older records are in the checkpoint or were replayed already
+                    Insert(key);
+                    logSequence=sequence;
+                }
+            }
+            carry=len-pos;   // a record split across chunks moves to the front
+            memmove(chunk.data(), chunk.data()+pos, carry);
+            if (len<chunk.size()){   // hit end of file, anything carried over is a torn last write
+                break;
+            }
+        }
+        if (carry>0 && ftruncate(fd, total-carry)!=0){   // so records appended later start on a record boundary
+            throw runtime_error(string("ftruncate failed: ")+strerror(errno));
+        }
+    }
+    catch (...){
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+/*
+Builds a balanced tree from count nodes handed over in key order, in linear time.
+Only the keys are read, so the nodes can be new or taken from an old tree. The
+middle key becomes the subtree root, so every level except the deepest is full.
+Coloring the deepest level red and everything else black then gives every path
+the same black height.
+*/
+
+int RedBlackTree::DeepestLevel(size_t count){
+    int depth=0;
+    while ((size_t(2)<<depth)<=count){  // floor(log2(count))
+        depth++;
+    }
+    return depth;
+}
+
+RBTNode *RedBlackTree::BuildBalanced(size_t count, int depth, int redDepth, RBTNode *parent, const function<RBTNode *()> &next){
+    if (count==0){
+        return nullptr;
+    }
+    size_t leftCount=(count-1)/2;
+    RBTNode *left=BuildBalanced(leftCount, depth+1, redDepth, nullptr, next);   // nodes arrive in order, so the left side first
+    RBTNode *n;
+    try{
+        n=next();
+    }
+    catch (...){
+        del(left);   // only this frame holds the nodes built so far
+        throw;
+    }
+    n->parent=parent;
+    n->left=left;
+    if (left!=nullptr){
+        left->parent=n;
+    }
+    n->color=(depth==redDepth && depth>0) ? COLOR_RED : COLOR_BLACK;
+    n->right=nullptr;
+    try{
+        n->right=BuildBalanced(count-1-leftCount, depth+1, redDepth, n, next);
+    }
+    catch (...){
+        del(n);
+        throw;
+    }
+    UpdateAggregate(n);
+    return n;
+}
+
+
+/*
+Write buffer
+
+Random inserts into a big tree miss the cache on nearly every level. Buffered keys
+are appended unsorted, which is O(1), and the batch is sorted once when it's
+flushed. Each key then starts from the node the previous key went into (the
+finger) and only climbs until its key range holds the new key, so a batch of b
+keys into n costs about log(n/b) levels per key instead of log n from the root.
+Once the batch is at least 1/WRITE_BUFFER_REBUILD_RATIO of the tree, relinking
+every node is cheaper: the old nodes and the new keys are merged in order and
+BuildBalanced rebuilds the tree in linear time, reusing the old nodes.
+
+The price is on the read side. Contains has to scan the unsorted buffer, which is
+sequential and cheap for a few thousand keys but grows with the threshold, and
+readers that need key order (cursors, RangeAggregate, ExportSorted, ==) sort a
+copy of the buffer first.
+*/
+
+void RedBlackTree::EnableWriteBuffer(size_t threshold){
+    if (threshold==0){
+        throw invalid_argument("Write buffer threshold must be at least 1");
+    }
+    writeBufferLimit=threshold;
+    writeBuffer.reserve(threshold+1);
+}
+
+void RedBlackTree::CollectInOrder(RBTNode *n, vector<RBTNode *> &nodes){
+    if (n==nullptr){
+        return;
+    }
+    CollectInOrder(n->left, nodes);
+    nodes.push_back(n);
+    CollectInOrder(n->right, nodes);
+}
+
+RBTNode *RedBlackTree::FingerStart(RBTNode *finger, int data){
+    RBTNode *n=finger;   // keys come in ascending order, so only the upper bound can be too low
+    while (n->parent!=nullptr && !(n==n->parent->left && data<n->parent->data)){
+        n=n->parent;   // a right child is bounded by whatever bounds its parent
+    }
+    return n;
+}
+
+void RedBlackTree::FlushWriteBuffer(){
+    if (writeBuffer.empty()){
+        return;
+    }
+    sort(writeBuffer.begin(), writeBuffer.end());
+    size_t treeCount=numItems-writeBuffer.size();
+    if (writeBuffer.size()*WRITE_BUFFER_REBUILD_RATIO>=treeCount){   // relink the old nodes around the new keys
+        vector<RBTNode *> nodes;
+        nodes.reserve(numItems);
+        CollectInOrder(root, nodes);
+        try{   // allocate up front, BuildBalanced frees what it built if next() throws
+            for (int key : writeBuffer){
+                RBTNode *n=new RBTNode;
+                n->data=key;
+                nodes.push_back(n);
+            }
+        }
+        catch (...){
+            for (size_t k=treeCount; k<nodes.size(); k++){
+                delete nodes[k];
+            }
+            throw;
+        }
+        inplace_merge(nodes.begin(), nodes.begin()+treeCount, nodes.end(),   // stable, tree nodes stay first among equal keys
+            [](const RBTNode *a, const RBTNode *b){ return a->data<b->data; });
+        size_t pos=0;
+        root=BuildBalanced(numItems, 0, DeepestLevel(numItems), nullptr, [&](){ return nodes[pos++]; });
+    }
+    else{
+        RBTNode *finger=nullptr;
+        for (int key : writeBuffer){
+            finger=InsertIntoTree(key, (finger!=nullptr) ? FingerStart(finger, key) : nullptr);
+        }
+    }
+    writeBuffer.clear();
+}
+
+
+/*
+Membership filter
+
+A blocked Bloom filter: each key picks one 64 byte block and sets filterHashes bits
+inside it. The blocks are 64 byte aligned, so each is a single cache line and a
+miss costs one probe. It's sized for twice
+the current count and rebuilt from the keys once the count passes that.
+*/
+
+static uint64_t MixHash(uint64_t x){   // splitmix64 finalizer
+    x^=x>>30;
+    x*=0xbf58476d1ce4e5b9ULL;
+    x^=x>>27;
+    x*=0x94d049bb133111ebULL;
+    x^=x>>31;
+    return x;
+}
+
+void RedBlackTree::EnableFilter(size_t bitsPerKey){
+    if (bitsPerKey==0){
+        throw invalid_argument("Filter needs at least one bit per key");
+    }
+    filterBitsPerKey=bitsPerKey;
+    filterHashes=(size_t)(bitsPerKey*0.69+0.5);   // k = ln 2 * bits per key is optimal
+    if (filterHashes<1){
+        filterHashes=1;
+    }
+    if (filterHashes>FILTER_MAX_HASHES){
+        filterHashes=FILTER_MAX_HASHES;
+    }
+    RebuildFilter();
+}
+
+void RedBlackTree::RebuildFilter(){
+    filterCapacity=max<size_t>(2*numItems, FILTER_MIN_CAPACITY);
+    size_t blocks=(filterCapacity*filterBitsPerKey+FILTER_BLOCK_BITS-1)/FILTER_BLOCK_BITS;
+    filterBlocks.assign(blocks, FilterBlock());
+    FilterAddTree(root);
+    for (int key : writeBuffer){
+        FilterAdd(key);
+    }
+}
+
+void RedBlackTree::FilterAddTree(const RBTNode *n){
+    if (n==nullptr){
+        return;
+    }
+    FilterAdd(n->data);
+    FilterAddTree(n->left);
+    FilterAddTree(n->right);
+}
+
+void RedBlackTree::FilterAdd(int data){
+    uint64_t h=MixHash((uint32_t)data);
+    uint64_t *block=filterBlocks[(h>>32)*filterBlocks.size()>>32].words;   // high bits pick the block
+    uint64_t bits=MixHash(h);
+    for (size_t i=0; i<filterHashes; i++){   // 9 bits per probe address a bit inside the 512 bit block
+        unsigned bit=(bits>>(i*9))&(FILTER_BLOCK_BITS-1);
+        block[bit/64]|=uint64_t(1)<<(bit%64);
+    }
+}
+
+bool RedBlackTree::FilterMayContain(int data) const{
+    uint64_t h=MixHash((uint32_t)data);
+    const uint64_t *block=filterBlocks[(h>>32)*filterBlocks.size()>>32].words;
+    uint64_t bits=MixHash(h);
+    for (size_t i=0; i<filterHashes; i++){
+        unsigned bit=(bits>>(i*9))&(FILTER_BLOCK_BITS-1);
+        if ((block[bit/64]&(uint64_t(1)<<(bit%64)))==0){
+            return false;  // one clear bit means the key was never added
+        }
+    }
+    return true;
+}
+
+double RedBlackTree::FilterFalsePositiveRate() const{
+    if (filterBitsPerKey==0){
+        return 1.0;  // no filter, every miss walks the tree
+    }
+    size_t setBits=0;
+    for (const FilterBlock &block : filterBlocks){
+        for (uint64_t word : block.words){
+            setBits+=__builtin_popcountll(word);
+        }
+    }
+    double fill=(double)setBits/(filterBlocks.size()*FILTER_BLOCK_BITS);
+    return pow(fill, (double)filterHashes);   // chance that all probed bits happen to be set
+}
+
+size_t RedBlackTree::FilterMemoryUsage() const{
+    return filterBlocks.size()*sizeof(FilterBlock);
+}
+
+
+/*
+Memory accounting and compaction
+
+Nodes get allocated one at a time in insertion order, so neighbours in key order end
+up all over the heap. Compact() copies the nodes into one block in in-order
+position, fixing left/right/parent as it goes, and frees the old ones.
+*/
+
+#define MALLOC_ALIGNMENT 16
+#define MALLOC_HEADER 8   // glibc keeps the chunk size in front of each allocation
+#define PAGE_SIZE_BYTES 4096
+
+void RedBlackTree::MeasureNodes(const RBTNode *n, const RBTNode *&previous, size_t &pageJumps, RBTMemoryUsage &usage){
+    if (n==nullptr){
+        return;
+    }
+    MeasureNodes(n->left, previous, pageJumps, usage);
+    usage.nodeCount++;
+    if (!n->InArena){
+        usage.scatteredNodes++;
+    }
+    if (previous!=nullptr && (uintptr_t)previous/PAGE_SIZE_BYTES!=(uintptr_t)n/PAGE_SIZE_BYTES){
+        pageJumps++;   // the in-order walk moves to a different page here
+    }
+    previous=n;
+    MeasureNodes(n->right, previous, pageJumps, usage);
+}
+
+RBTMemoryUsage RedBlackTree::MemoryUsage() const{
+    RBTMemoryUsage usage;
+    const RBTNode *previous=nullptr;
+    size_t pageJumps=0;
+    MeasureNodes(root, previous, pageJumps, usage);
+    usage.nodeBytes=usage.nodeCount*sizeof(RBTNode);
+    size_t chunk=(sizeof(RBTNode)+MALLOC_HEADER+MALLOC_ALIGNMENT-1)/MALLOC_ALIGNMENT*MALLOC_ALIGNMENT;
+    usage.allocatorOverhead=usage.scatteredNodes*(chunk-sizeof(RBTNode));
+    if (usage.nodeCount>1){
+        usage.fragmentation=(double)pageJumps/(usage.nodeCount-1);
+    }
+    usage.auxiliaryBytes=writeBuffer.capacity()*sizeof(int)+FilterMemoryUsage()+logPending.capacity();
+    return usage;
+}
+
+RBTNode *RedBlackTree::CompactCopy(const RBTNode *n, RBTNode *parent, RBTNode *block, size_t &next){
+    if (n==nullptr){
+        return nullptr;
+    }
+    RBTNode *left=CompactCopy(n->left, nullptr, block, next);   // left subtree takes the slots before this node
+    RBTNode *copy=&block[next++];
+    copy->data=n->data;
+    copy->color=n->color;
+    copy->InArena=true;
+    copy->parent=parent;
+    copy->left=left;
+    if (left!=nullptr){
+        left->parent=copy;
+    }
+    copy->right=CompactCopy(n->right, copy, block, next);
+    UpdateAggregate(copy);
+    return copy;
+}
+
+void RedBlackTree::Compact(){
+    size_t count=numItems-writeBuffer.size();
+    if (count==0){
+        return;
+    }
+    RBTNode *block=new RBTNode[count];
+    size_t next=0;
+    RBTNode *newRoot=CompactCopy(root, nullptr, block, next);
+    del(root);   // frees the separately allocated nodes
+    delete[] arena;   // and the previous block
+    arena=block;
+    root=newRoot;
+}
+
+
+/*
+Subtree aggregates
+
+With RBT_AUGMENT defined every node keeps Combine() over its subtree in in-order.
+A node's value only depends on its children, so BasicInsert refreshes the path
+up from the new leaf and the rotations refresh the two nodes that moved.
+*/
+
+#ifdef RBT_AUGMENT
+
+RBT_AUGMENT::Value RedBlackTree::AggregateOf(const RBTNode *n){
+    return n==nullptr ? RBT_AUGMENT::Identity() : n->aggregate;
+}
+
+void RedBlackTree::UpdateAggregate(RBTNode *n){
+    n->aggregate=RBT_AUGMENT::Combine(RBT_AUGMENT::Combine(AggregateOf(n->left), RBT_AUGMENT::Lift(n->data)), AggregateOf(n->right));
+}
+
+RBT_AUGMENT::Value RedBlackTree::TreeAggregate(int low, int high) const{
+    RBT_AUGMENT::Value result=RBT_AUGMENT::Identity();
+    const RBTNode *split=root;
+    while (split!=nullptr && (split->data<low || split->data>high)){  // first node inside the range
+        split=(split->data<low) ? split->right : split->left;
+    }
+    if (split!=nullptr){
+        RBT_AUGMENT::Value leftPart=RBT_AUGMENT::Identity();
+        const RBTNode *x=split->left;
+        while (x!=nullptr){   // everything here is <= high, only low can cut
+            if (x->data>=low){
+                leftPart=RBT_AUGMENT::Combine(RBT_AUGMENT::Lift(x->data), RBT_AUGMENT::Combine(AggregateOf(x->right), leftPart));
+                x=x->left;
+            }
+            else{
+                x=x->right;
+            }
+        }
+        RBT_AUGMENT::Value rightPart=RBT_AUGMENT::Identity();
+        x=split->right;
+        while (x!=nullptr){   // everything here is >= low, only high can cut
+            if (x->data<=high){
+                rightPart=RBT_AUGMENT::Combine(RBT_AUGMENT::Combine(rightPart, AggregateOf(x->left)), RBT_AUGMENT::Lift(x->data));
+                x=x->right;
+            }
+            else{
+                x=x->left;
+            }
+        }
+        result=RBT_AUGMENT::Combine(RBT_AUGMENT::Combine(leftPart, RBT_AUGMENT::Lift(split->data)), rightPart);
+    }
+    return result;
+}
+
+RBT_AUGMENT::Value RedBlackTree::RangeAggregate(int low, int high) const{
+    if (low>high){
+        return RBT_AUGMENT::Identity();
+    }
+    RBT_AUGMENT::Value result=RBT_AUGMENT::Identity();
+    long long from=low;
+    vector<int> buffered;   // the buffer isn't sorted, pick out the keys in range
+    for (int key : writeBuffer){
+        if (key>=low && key<=high){
+            buffered.push_back(key);
+        }
+    }
+    sort(buffered.begin(), buffered.end());
+    for (int key : buffered){   // tree keys up to each buffered key, then the key, keeps in-order for any monoid
+        if (from<=key){
+            result=RBT_AUGMENT::Combine(result, TreeAggregate((int)from, key));
+        }
+        result=RBT_AUGMENT::Combine(result, RBT_AUGMENT::Lift(key));
+        from=(long long)key+1;
+    }
+    if (from<=high){
+        result=RBT_AUGMENT::Combine(result, TreeAggregate((int)from, high));
+    }
+    return result;
+}
+
+#else
+
+void RedBlackTree::UpdateAggregate(RBTNode *){   // nothing to keep up to date
+}
+
+#endif
+
+
+/*
+Out-of-core build
+
+SortKeyFile is a plain external merge sort. It cuts the input into runs that fit in
+memoryBudget, sorts and spills each one, then merges all runs in one pass with a
+small heap. The output is the keys as raw sorted ints, the same layout Checkpoint
+writes after its header, and it can be mmapped and binary searched as it is. LoadSortedFile then
+streams such a file into a balanced tree without ever holding the keys in an array.
+*/
+
+#define KEY_CHUNK_BYTES (1<<18)
+#define MIN_RUN_READ_KEYS 4096
+#define MERGE_BUFFER_BYTES (64<<10)   // read buffer per run while merging
+#define MERGE_FD_MARGIN 16   // file descriptors left for the rest of the program
+#define MAX_MERGE_FAN_IN 1024
+
+// Hands out keys from a file in large sequential reads, either raw ints or
+// text with any non-digit characters between the numbers.
+class KeyFileReader {
+    public:
+        KeyFileReader(const string &path, bool textKeys, size_t chunkBytes) : path(path), text(textKeys), chunkBytes(chunkBytes){
+            if (text){   // raw ints are read straight into the caller's buffer
+                chunk.resize(chunkBytes);
+            }
+            fd=open(path.c_str(), O_RDONLY);
+            if (fd==-1){
+                throw runtime_error("Cannot open "+path+": "+strerror(errno));
+            }
+        }
+        ~KeyFileReader(){
+            close(fd);
+        }
+
+        off_t Bytes() const{   // size of the open file, not whatever the path points at now
+            struct stat info;
+            if (fstat(fd, &info)!=0){
+                throw runtime_error("Cannot stat "+path+": "+strerror(errno));
+            }
+            return info.st_size;
+        }
+
+        void Skip(size_t bytes){   // jump over a header before the first key
+            if (lseek(fd, bytes, SEEK_SET)==(off_t)-1){
+                throw runtime_error("Cannot seek in "+path+": "+strerror(errno));
+            }
+        }
+
+        size_t Fill(int *out, size_t max){   // returns how many keys were read, 0 at the end
+            if (!text){
+                size_t bytes=ReadFull(fd, (char *)out, max*sizeof(int));
+                if (bytes%sizeof(int)!=0){
+                    throw runtime_error("Key file "+path+" is truncated");
+                }
+                return bytes/sizeof(int);
+            }
+            size_t filled=0;
+            while (filled<max){
+                if (pos==len){
+                    len=ReadFull(fd, chunk.data(), chunk.size());
+                    pos=0;
+                    if (len==0){   // end of file ends the last number too
+                        if (inNumber){
+                            out[filled++]=TakeNumber();
+                        }
+                        break;
+                    }
+                }
+                char c=chunk[pos++];
+                if (c>='0' && c<='9'){
+                    value=value*10+(c-'0');
+                    if (value>(long long)INT_MAX+1){   // stop before it can overflow, INT_MIN needs the +1
+                        throw runtime_error("Key out of int range in "+path);
+                    }
+                    inNumber=true;
+                }
+                else if (c=='-'){   // starts a new negative number, even right after a digit
+                    if (inNumber){
+                        out[filled++]=TakeNumber();
+                    }
+                    negative=true;
+                }
+                else{   // anything else separates numbers, which may span two chunks
+                    if (inNumber){
+                        out[filled++]=TakeNumber();
+                    }
+                    negative=false;
+                }
+            }
+            return filled;
+        }
+
+        bool Next(int &key){   // one key at a time from an internal buffer
+            if (keyPos==keys.size()){
+                keys.resize(chunkBytes/sizeof(int));
+                keys.resize(Fill(keys.data(), keys.size()));
+                keyPos=0;
+                if (keys.empty()){
+                    return false;
+                }
+            }
+            key=keys[keyPos++];
+            return true;
+        }
+
+    private:
+        int TakeNumber(){   // the number just parsed, and resets for the next one
+            long long number=negative ? -value : value;
+            if (number>INT_MAX || number<INT_MIN){
+                throw runtime_error("Key out of int range in "+path);
+            }
+            value=0;
+            inNumber=false;
+            negative=false;
+            return (int)number;
+        }
+
+        string path;
+        bool text;
+        size_t chunkBytes;
+        int fd;
+        vector<char> chunk;
+        size_t pos=0;
+        size_t len=0;
+        long long value=0;
+        bool inNumber=false;
+        bool negative=false;
+        vector<int> keys;
+        size_t keyPos=0;
+};
+
+// LSD radix sort, one byte per pass, with the sign bit flipped so negatives come
+// first. About three times faster than std::sort on ints, at the cost of a scratch
+// buffer as big as the run.
+static void RadixSort(vector<int> &keys, vector<int> &scratch){
+    scratch.resize(keys.size());
+    uint32_t *from=(uint32_t *)keys.data();
+    uint32_t *to=(uint32_t *)scratch.data();
+    for (int shift=0; shift<32; shift+=8){
+        size_t offsets[257]={0};
+        for (size_t i=0; i<keys.size(); i++){
+            offsets[((from[i]^0x80000000u)>>shift&255)+1]++;
+        }
+        for (int b=0; b<256; b++){
+            offsets[b+1]+=offsets[b];
+        }
+        for (size_t i=0; i<keys.size(); i++){
+            to[offsets[(from[i]^0x80000000u)>>shift&255]++]=from[i];
+        }
+        swap(from, to);
+    }   // four passes, so the result ends up back in keys
+}
+
+static void WriteRun(const string &path, const vector<int> &keys){
+    int fd=open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd==-1){
+        throw runtime_error("Cannot open "+path+": "+strerror(errno));
+    }
+    try{
+        WriteAll(fd, (const char *)keys.data(), keys.size()*sizeof(int));
+    }
+    catch (...){   // e.g. ENOSPC, SortKeyFile removes the file
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+// Merges sorted runs into one file. Each run gets its own read buffer of readKeys
+// keys and the output gets one more, so this holds (inputs+1)*readKeys keys.
+static void MergeRuns(const vector<string> &inputs, const string &outputPath, size_t readKeys){
+    vector<unique_ptr<KeyFileReader>> runs;
+    typedef pair<int, size_t> HeapEntry;   // next key of a run, and which run
+    priority_queue<HeapEntry, vector<HeapEntry>, greater<HeapEntry>> heap;
+    for (size_t i=0; i<inputs.size(); i++){
+        runs.push_back(unique_ptr<KeyFileReader>(new KeyFileReader(inputs[i], false, readKeys*sizeof(int))));
+        int key;
+        if (runs[i]->Next(key)){
+            heap.push(make_pair(key, i));
+        }
+    }
+    int fd=open(outputPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd==-1){
+        throw runtime_error("Cannot open "+outputPath+": "+strerror(errno));
+    }
+    try{
+        vector<int> out;
+        out.reserve(readKeys);
+        while (!heap.empty()){
+            HeapEntry smallest=heap.top();
+            heap.pop();
+            out.push_back(smallest.first);
+            if (out.size()==out.capacity()){
+                WriteAll(fd, (const char *)out.data(), out.size()*sizeof(int));
+                out.clear();
+            }
+            int key;
+            if (runs[smallest.second]->Next(key)){   // refill from the run we just took from
+                heap.push(make_pair(key, smallest.second));
+            }
+        }
+        WriteAll(fd, (const char *)out.data(), out.size()*sizeof(int));
+    }
+    catch (...){
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+static void RemoveRuns(vector<string> &runPaths){
+    for (const string &runPath : runPaths){
+        remove(runPath.c_str());
+    }
+    runPaths.clear();
+}
+
+void RedBlackTree::SortKeyFile(const string &keyPath, bool textKeys, const string &sortedPath, size_t memoryBudget){
+    size_t runKeys=max<size_t>(memoryBudget/2/sizeof(int), MIN_RUN_READ_KEYS);   // half for the run, half for sort scratch
+    vector<string> runPaths;   // runs waiting for the next merge pass
+    vector<string> merged;   // runs written by the current pass
+    size_t nextRun=0;
+    try{
+        {
+            KeyFileReader input(keyPath, textKeys, KEY_CHUNK_BYTES);
+            vector<int> run(runKeys);
+            vector<int> scratch;
+            while (true){
+                size_t filled=0;
+                size_t got;
+                while (filled<runKeys && (got=input.Fill(run.data()+filled, runKeys-filled))>0){
+                    filled+=got;
+                }
+                if (filled==0 && !runPaths.empty()){
+                    break;
+                }
+                run.resize(filled);
+                RadixSort(run, scratch);
+                runPaths.push_back(sortedPath+".run"+to_string(nextRun++));
+                WriteRun(runPaths.back(), run);
+                if (filled<runKeys){   // short run means the input is used up
+                    break;
+                }
+            }
+        }
+        if (runPaths.size()==1){   // everything fit in memory, no merge needed
+            if (rename(runPaths[0].c_str(), sortedPath.c_str())!=0){
+                throw runtime_error(string("rename failed: ")+strerror(errno));
+            }
+            return;
+        }
+
+        // fan-in is limited by memory (64KB of buffer per run) and by open files
+        size_t fileLimit=MAX_MERGE_FAN_IN;
+        struct rlimit files;
+        if (getrlimit(RLIMIT_NOFILE, &files)==0 && files.rlim_cur!=RLIM_INFINITY){
+            fileLimit=(files.rlim_cur>MERGE_FD_MARGIN+2) ? files.rlim_cur-MERGE_FD_MARGIN : 2;
+        }
+        size_t fanIn=min(max<size_t>(memoryBudget/MERGE_BUFFER_BYTES, 2), min<size_t>(fileLimit, MAX_MERGE_FAN_IN));
+        size_t readKeys=max<size_t>(memoryBudget/sizeof(int)/(fanIn+1), MIN_RUN_READ_KEYS);   // the budget is shared by the run buffers and the output
+        while (runPaths.size()>fanIn){   // earlier passes merge groups of runs into longer runs
+            for (size_t first=0; first<runPaths.size(); first+=fanIn){
+                vector<string> group(runPaths.begin()+first, runPaths.begin()+min(first+fanIn, runPaths.size()));
+                merged.push_back(sortedPath+".run"+to_string(nextRun++));
+                MergeRuns(group, merged.back(), readKeys);
+            }
+            RemoveRuns(runPaths);   // every input is in some merged run now
+            runPaths.swap(merged);
+        }
+        MergeRuns(runPaths, sortedPath, readKeys);
+    }
+    catch (...){   // don't leave runs behind on failure
+        RemoveRuns(runPaths);
+        RemoveRuns(merged);
+        throw;
+    }
+    RemoveRuns(runPaths);
+}
+
+void RedBlackTree::LoadSortedFile(const string &sortedPath){
+    LoadSortedKeys(sortedPath, 0);
+}
+
+void RedBlackTree::LoadSortedKeys(const string &sortedPath, size_t headerBytes){
+    if (numItems!=0){
+        throw invalid_argument("LoadSortedFile needs an empty tree");
+    }
+    KeyFileReader input(sortedPath, false, KEY_CHUNK_BYTES);
+    input.Skip(headerBytes);
+    off_t bytes=input.Bytes();
+    if (bytes<(off_t)headerBytes || (bytes-headerBytes)%sizeof(int)!=0){   // check before any node exists
+        throw runtime_error("Key file "+sortedPath+" is truncated");
+    }
+    size_t count=(bytes-headerBytes)/sizeof(int);
+    long long previous=LLONG_MIN;
+    root=BuildBalanced(count, 0, DeepestLevel(count), nullptr, [&](){   // keys arrive in order, one chunk at a time
+        int key;
+        if (!input.Next(key)){
+            throw runtime_error("Key file "+sortedPath+" is truncated");
+        }
+        if (key<previous){   // out of order keys would build a tree that can't find them
+            throw runtime_error("Key file "+sortedPath+" is not sorted");
+        }
+        previous=key;
+        RBTNode *n=new RBTNode;
+        n->data=key;
+        return n;
+    });
+    numItems=count;
+    if (filterBitsPerKey>0){
+        RebuildFilter();
+    }
+}
+
+void RedBlackTree::BuildFromKeyFile(const string &keyPath, bool textKeys, const string &sortedPath, size_t memoryBudget){
+    if (numItems!=0){
+        throw invalid_argument("BuildFromKeyFile needs an empty tree");
+    }
+    SortKeyFile(keyPath, textKeys, sortedPath, memoryBudget);
+    LoadSortedFile(sortedPath);
+}
+
+
+/*
+Comparing trees
+
+operator== is the native version of comparing ToPrefixString output. SameKeys walks
+both trees in key order with parent pointers and stops at the first difference.
+With RBT_MERKLE every subtree carries a hash of its keys, so SameKeys is a single
+comparison of the root hashes (a false match needs a 64 bit collision), and
+DiffRanges bisects the key space, only descending where the range hashes differ.
+*/
+
+RedBlackTree::InOrderCursor::InOrderCursor(const RedBlackTree &rbt) : node(rbt.root), buffer(rbt.writeBuffer), bufferPos(0){
+    sort(buffer.begin(), buffer.end());
+    while (node!=nullptr && node->left!=nullptr){  // start at the minimum
+        node=node->left;
+    }
+}
+
+bool RedBlackTree::InOrderCursor::Next(int &key){
+    bool fromBuffer=bufferPos<buffer.size() && (node==nullptr || buffer[bufferPos]<node->data);
+    if (fromBuffer){
+        key=buffer[bufferPos++];
+        return true;
+    }
+    if (node==nullptr){
+        return false;
+    }
+    key=node->data;
+    if (node->right!=nullptr){   // successor is the leftmost node of the right subtree
+        node=node->right;
+        while (node->left!=nullptr){
+            node=node->left;
+        }
+    }
+    else{   // or the first ancestor we reach from its left side
+        while (node->parent!=nullptr && node==node->parent->right){
+            node=node->parent;
+        }
+        node=node->parent;
+    }
+    return true;
+}
+
+bool RedBlackTree::SameShape(const RBTNode *a, const RBTNode *b){
+    if (a==nullptr || b==nullptr){
+        return a==b;
+    }
+    return a->data==b->data && a->color==b->color && SameShape(a->left, b->left) && SameShape(a->right, b->right);
+}
+
+bool RedBlackTree::operator==(const RedBlackTree &other) const{
+    if (numItems!=other.numItems || writeBuffer.size()!=other.writeBuffer.size()){
+        return false;
+    }
+#ifdef RBT_MERKLE
+    if (AggregateOf(root)!=AggregateOf(other.root)){   // cheap way to rule most mismatches out
+        return false;
+    }
+#endif
+    if (!SameShape(root, other.root)){
+        return false;
+    }
+    vector<int> mine(writeBuffer);   // same buffered keys in any order
+    vector<int> theirs(other.writeBuffer);
+    sort(mine.begin(), mine.end());
+    sort(theirs.begin(), theirs.end());
+    return mine==theirs;
+}
+
+bool RedBlackTree::SameKeys(const RedBlackTree &other) const{
+    if (numItems!=other.numItems){
+        return false;
+    }
+#ifdef RBT_MERKLE
+    if (writeBuffer.empty() && other.writeBuffer.empty()){
+        return AggregateOf(root)==AggregateOf(other.root);
+    }
+#endif
+    InOrderCursor mine(*this);
+    InOrderCursor theirs(other);
+    int a;
+    int b;
+    while (mine.Next(a)){
+        if (!theirs.Next(b) || a!=b){
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef RBT_MERKLE
+
+void RedBlackTree::DiffRanges(const RedBlackTree &other, vector<pair<int, int>> &ranges) const{
+    ranges.clear();
+    DiffRanges(other, INT_MIN, INT_MAX, ranges);
+}
+
+void RedBlackTree::DiffRanges(const RedBlackTree &other, long long low, long long high, vector<pair<int, int>> &ranges) const{
+    if (RangeAggregate((int)low, (int)high)==other.RangeAggregate((int)low, (int)high)){
+        return;   // same keys in here, nothing to look at
+    }
+    if (low==high){
+        if (!ranges.empty() && ranges.back().second==low-1){   // extend the previous range if it touches
+            ranges.back().second=(int)low;
+        }
+        else{
+            ranges.push_back(make_pair((int)low, (int)high));
+        }
+        return;
+    }
+    long long mid=low+(high-low)/2;
+    DiffRanges(other, low, mid, ranges);
+    DiffRanges(other, mid+1, high, ranges);
+}
+
+#endif
+
+
+/*
+Sorted export
+
+ExportSorted writes keys straight into the caller's array. For a big tree the top
+few levels are cut off: the nodes above the cut become single keys and every
+subtree below it becomes one piece of work. A counting pass gives each piece its
+offset, then threads export the pieces independently. Buffered keys are merged
+in from the back afterwards, so no extra array is needed.
+*/
+
+size_t RedBlackTree::CountNodes(const RBTNode *n){
+    if (n==nullptr){
+        return 0;
+    }
+    return CountNodes(n->left)+1+CountNodes(n->right);
+}
+
+int *RedBlackTree::ExportSubtree(const RBTNode *n, int *out){
+    while (n!=nullptr){   // loop on the right side, recurse on the left
+        out=ExportSubtree(n->left, out);
+        *out++=n->data;
+        n=n->right;
+    }
+    return out;
+}
+
+void RedBlackTree::SplitForExport(const RBTNode *n, int depth, vector<const RBTNode *> &pieces, vector<bool> &whole){
+    if (n==nullptr){
+        return;
+    }
+    if (depth==0){
+        pieces.push_back(n);   // a whole subtree
+        whole.push_back(true);
+        return;
+    }
+    SplitForExport(n->left, depth-1, pieces, whole);
+    pieces.push_back(n);   // just this node's key
+    whole.push_back(false);
+    SplitForExport(n->right, depth-1, pieces, whole);
+}
+
+void RedBlackTree::ExportSorted(int *out, unsigned threads) const{
+    size_t treeCount=numItems-writeBuffer.size();
+    if (threads==0){
+        threads=(treeCount<PARALLEL_EXPORT_MIN) ? 1 : thread::hardware_concurrency();
+    }
+    if (threads<2){
+        ExportSubtree(root, out);
+    }
+    else{
+        int depth=0;
+        while ((1u<<depth)<4*threads){   // a few pieces per thread evens out unequal subtrees
+            depth++;
+        }
+        vector<const RBTNode *> pieces;
+        vector<bool> whole;
+        SplitForExport(root, depth, pieces, whole);
+        vector<size_t> offsets(pieces.size()+1, 0);
+        vector<thread> workers;
+        for (unsigned t=0; t<threads; t++){   // sizing pass, counts go in offsets[i+1]
+            workers.push_back(thread([&, t](){
+                for (size_t i=t; i<pieces.size(); i+=threads){
+                    offsets[i+1]=whole[i] ? CountNodes(pieces[i]) : 1;
+                }
+            }));
+        }
+        for (thread &worker : workers){
+            worker.join();
+        }
+        workers.clear();
+        for (size_t i=0; i<pieces.size(); i++){
+            offsets[i+1]+=offsets[i];
+        }
+        for (unsigned t=0; t<threads; t++){
+            workers.push_back(thread([&, t](){
+                for (size_t i=t; i<pieces.size(); i+=threads){
+                    if (whole[i]){
+                        ExportSubtree(pieces[i], out+offsets[i]);
+                    }
+                    else{
+                        out[offsets[i]]=pieces[i]->data;
+                    }
+                }
+            }));
+        }
+        for (thread &worker : workers){
+            worker.join();
+        }
+    }
+    vector<int> buffered(writeBuffer);
+    sort(buffered.begin(), buffered.end());
+    long long i=(long long)treeCount-1;   // merge the buffer in from the back
+    long long j=(long long)buffered.size()-1;
+    long long k=(long long)numItems-1;
+    while (j>=0){
+        if (i>=0 && out[i]>buffered[j]){
+            out[k--]=out[i--];
+        }
+        else{
+            out[k--]=buffered[j--];
+        }
+    }
+}
+
+void RedBlackTree::ExportSorted(int *buffer, size_t chunkSize, const function<void(const int *, size_t)> &sink) const{
+    if (chunkSize==0){
+        throw invalid_argument("Chunk size must be at least 1");
+    }
+    InOrderCursor cursor(*this);
+    size_t filled=0;
+    int key;
+    while (cursor.Next(key)){
+        buffer[filled++]=key;
+        if (filled==chunkSize){
+            sink(buffer, filled);
+            filled=0;
+        }
+    }
+    if (filled>0){
+        sink(buffer, filled);
+    }
+}
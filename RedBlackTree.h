@@ -6,12 +6,100 @@
 #define COLOR_BLACK 1
 #define COLOR_DOUBLE_BLACK 2
 
+#define LOG_OP_INSERT 1
+#define LOG_RECORD_SIZE 13   // op byte, 8 byte sequence number, 4 byte key
+#define CHECKPOINT_MAGIC 0x3154504b43544252ULL   // "RBTCKPT1"
+#define CHECKPOINT_HEADER_SIZE 16   // magic, then the last sequence number it covers
+
+#define FILTER_BLOCK_BITS 512   // one cache line
+#define FILTER_BLOCK_WORDS 8
+#define FILTER_MAX_HASHES 7   // 7 probes of 9 bits fit in a 64 bit hash
+#define FILTER_MIN_CAPACITY 1024
+
+#define WRITE_BUFFER_REBUILD_RATIO 8   // rebuild once a flushed batch is 1/8 of the tree
+#define PARALLEL_EXPORT_MIN (1<<20)   // smaller trees aren't worth starting threads for
+
 #include <iostream>
 #include <climits>
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
 
 using namespace std;
 
 
+/*
+Monoids for subtree aggregates. Building with -DRBT_AUGMENT=SumMonoid (or another
+struct with the same members) keeps Combine() of every subtree in its root node and
+enables RangeAggregate. Without it RBTNode has no extra field and the upkeep calls
+are empty.
+
+RBTNode and RedBlackTree change layout with these flags, so every translation
+unit that includes this header, RedBlackTree.cpp included, has to be built with
+the same RBT_AUGMENT / RBT_MERKLE setting. Mixing them links fine and then reads
+the wrong fields.
+*/
+
+struct SumMonoid {
+	typedef long long Value;
+	static Value Identity() { return 0; }
+	static Value Lift(int data) { return data; }
+	static Value Combine(Value a, Value b) { return a+b; }
+};
+
+struct MaxMonoid {
+	typedef int Value;
+	static Value Identity() { return INT_MIN; }
+	static Value Lift(int data) { return data; }
+	static Value Combine(Value a, Value b) { return a>b ? a : b; }
+};
+
+// Polynomial hash of the keys in in-order, so two trees holding the same keys have
+// the same root value whatever their shape. Building with -DRBT_MERKLE selects it.
+struct HashMonoid {
+	struct Value {
+		uint64_t hash;
+		uint64_t power;   // BASE to the number of keys hashed
+		bool operator==(const Value &other) const { return hash==other.hash && power==other.power; }
+		bool operator!=(const Value &other) const { return !(*this==other); }
+	};
+	static const uint64_t BASE = 0x100000001b3ULL;
+	static Value Identity() { return Value{0, 1}; }
+	static Value Lift(int data) {
+		uint64_t x=(uint32_t)data;   // splitmix64 finalizer, so nearby keys hash far apart
+		x=(x^(x>>30))*0xbf58476d1ce4e5b9ULL;
+		x=(x^(x>>27))*0x94d049bb133111ebULL;
+		return Value{x^(x>>31), BASE};
+	}
+	static Value Combine(Value a, Value b) { return Value{a.hash*b.power+b.hash, a.power*b.power}; }
+};
+
+#ifdef RBT_MERKLE
+#ifdef RBT_AUGMENT
+#error "RBT_MERKLE selects HashMonoid itself, don't also define RBT_AUGMENT"
+#endif
+#define RBT_AUGMENT HashMonoid
+#endif
+
+
+/*
+The search loop behind Get, shared with StaticRedBlackTree. Node can be a pointer or
+an index, key(x) reads the node's value and child(x, goLeft) steps down a level.
+*/
+
+template <typename Node, typename Key, typename Child>
+constexpr Node SearchTree(Node x, Node none, int data, Key key, Child child){
+	while (x!=none){
+		if (data==key(x)){   // if data matches our node's value, return node
+			return x;
+		}
+		x=child(x, data<key(x));   // smaller goes left, bigger goes right
+	}
+	return none;  // otherwise node doesn't exist
+}
+
+
 struct RBTNode {
 	int data;
 	unsigned short int color;
@@ -19,6 +107,27 @@ struct RBTNode {
 	RBTNode *right = nullptr;
 	RBTNode *parent = nullptr;
 	bool IsNullNode = false;
+	bool InArena = false;   // lives in the tree's compacted block, not its own allocation
+#ifdef RBT_AUGMENT
+	RBT_AUGMENT::Value aggregate = RBT_AUGMENT::Identity();   // over this node's whole subtree
+#endif
+};
+
+
+// one filter block, aligned so it never straddles two cache lines
+struct alignas(64) FilterBlock {
+	uint64_t words[FILTER_BLOCK_WORDS];
+};
+static_assert(sizeof(FilterBlock)*8==FILTER_BLOCK_BITS, "a filter block is one cache line");
+
+
+struct RBTMemoryUsage {
+	size_t nodeCount = 0;
+	size_t nodeBytes = 0;   // sizeof(RBTNode) for every node in the tree
+	size_t allocatorOverhead = 0;   // malloc headers and rounding of separately allocated nodes
+	size_t scatteredNodes = 0;   // nodes outside the compacted block
+	double fragmentation = 0;   // share of in-order steps that jump to another page
+	size_t auxiliaryBytes = 0;   // write buffer, filter and pending log records
 };
 
 
@@ -28,6 +137,7 @@ class RedBlackTree {
 		RedBlackTree();
 		RedBlackTree(int newData);
 		RedBlackTree(const RedBlackTree &rbt);
+		RedBlackTree &operator=(const RedBlackTree &rbt) = delete;   // owns the log fd and compacted block
 		~RedBlackTree();
 
 		string ToInfixString() const {return ToInfixString(root);};
@@ -43,10 +153,89 @@ class RedBlackTree {
 		int GetMin() const;
 		int GetMax() const;
 		RBTNode *GetUncle(RBTNode *node);
+
+		// optional write-ahead log, every mutation is appended and made
+		// durable in groups of groupCommitSize records. The destructor commits the
+		// last group but can only report a failure, call FlushLog() to get the error.
+		// After a failed commit the log is never written again: every later Insert
+		// and FlushLog throws, and the state on disk is whatever Recover finds.
+		void EnableLog(const string &logPath, size_t groupCommitSize);
+		void FlushLog();
+		void Checkpoint(const string &checkpointPath);
+		void Recover(const string &checkpointPath, const string &logPath);
+
+		// building from key files bigger than memory. SortKeyFile uses about
+		// max(memoryBudget, 48KB) + 256KB. It merges at most min(memoryBudget/64KB,
+		// open file limit - 16) runs at a time, in as many passes as that takes, and
+		// writes raw sorted ints that can be mmapped and binary searched directly.
+		// Loading one adds 256KB of buffer plus the nodes themselves.
+		static void SortKeyFile(const string &keyPath, bool textKeys, const string &sortedPath, size_t memoryBudget);
+		void LoadSortedFile(const string &sortedPath);
+		void BuildFromKeyFile(const string &keyPath, bool textKeys, const string &sortedPath, size_t memoryBudget);
+
+		// optional write buffer in front of the tree, inserts are appended there and
+		// sorted and merged into the tree once it holds more than threshold keys.
+		// Contains scans the unsorted buffer, so a lookup costs up to threshold
+		// compares on top of the tree walk. The ToString methods only show the tree,
+		// call FlushWriteBuffer() first.
+		void EnableWriteBuffer(size_t threshold);
+		void FlushWriteBuffer();
+
+		// optional Bloom filter so Contains can reject most missing keys without
+		// walking the tree, FalsePositiveRate is an estimate from the fill level
+		void EnableFilter(size_t bitsPerKey);
+		double FilterFalsePositiveRate() const;
+		size_t FilterMemoryUsage() const;
+
+		// Compact() moves every node into one block in in-order position so scans
+		// and lookups touch neighbouring memory, nodes inserted later are allocated as usual
+		RBTMemoryUsage MemoryUsage() const;
+		void Compact();
+
+#ifdef RBT_AUGMENT
+		// Combine() over all keys in [low, high] in O(log n), plus O(log n) for
+		// each buffered key inside the range
+		RBT_AUGMENT::Value RangeAggregate(int low, int high) const;
+#endif
+
+		// == compares shape, colors and keys like comparing ToPrefixString does,
+		// SameKeys only compares the keys in order. Both stop at the first difference.
+		bool operator==(const RedBlackTree &other) const;
+		bool operator!=(const RedBlackTree &other) const {return !(*this==other);};
+		bool SameKeys(const RedBlackTree &other) const;
+
+		// all Size() keys in sorted order straight into out, big trees are split
+		// into subtrees that are exported on several threads at precomputed offsets.
+		// threads 0 uses every core once the tree has PARALLEL_EXPORT_MIN keys.
+		void ExportSorted(int *out, unsigned threads = 0) const;
+		// fills buffer chunkSize keys at a time and hands each chunk to sink
+		void ExportSorted(int *buffer, size_t chunkSize, const function<void(const int *, size_t)> &sink) const;
+#ifdef RBT_MERKLE
+		// key ranges where the two trees hold different keys, adjacent ranges merged
+		void DiffRanges(const RedBlackTree &other, vector<pair<int, int>> &ranges) const;
+#endif
 	
 	private: 
 		unsigned long long int numItems  = 0;
 		RBTNode *root = nullptr;
+
+		int logFd = -1;
+		size_t logGroupSize = 1;
+		vector<char> logPending;
+		unsigned long long logSequence = 0;   // sequence number of the last record appended
+		bool logFailed = false;   // a commit failed, retrying could duplicate or misalign records
+
+		size_t writeBufferLimit = 0;   // 0 means inserts go straight to the tree
+		vector<int> writeBuffer;   // unsorted until the flush
+		int writeBufferMin = 0;   // only valid while the buffer isn't empty
+		int writeBufferMax = 0;
+
+		size_t filterBitsPerKey = 0;   // 0 means no filter
+		size_t filterHashes = 0;
+		size_t filterCapacity = 0;   // rebuild once numItems passes this
+		vector<FilterBlock> filterBlocks;
+
+		RBTNode *arena = nullptr;   // block from the last Compact()
 		
 		static string ToInfixString(const RBTNode *n);
 		static string ToPrefixString(const RBTNode *n);
@@ -55,14 +244,53 @@ class RedBlackTree {
 		static string GetColorString(const RBTNode *n);
 		static string GetNodeString(const RBTNode *n);
 		RBTNode *GetUncle(RBTNode *node) const;
-		void BasicInsert(RBTNode *node);
+		RBTNode *InsertIntoTree(int newData, RBTNode *from = nullptr);
+		void BasicInsert(RBTNode *node, RBTNode *from = nullptr);
+		static RBTNode *FingerStart(RBTNode *finger, int data);
 		void InsertFixUp(RBTNode *node);
 		
 		bool IsLeftChild(RBTNode *node) const;
 		bool IsRightChild(RBTNode *node) const;
-		void del(RBTNode* node);
+		static void del(RBTNode* node);
 		RBTNode *CopyOf(const RBTNode *node);
 
+		void AppendLog(char op, int data);
+		void LoadSortedKeys(const string &sortedPath, size_t headerBytes);
+		static int DeepestLevel(size_t count);
+		static RBTNode *BuildBalanced(size_t count, int depth, int redDepth, RBTNode *parent, const function<RBTNode *()> &next);
+		static void WriteInOrder(const RBTNode *n, vector<int> &chunk, int fd);
+		static void CollectInOrder(RBTNode *n, vector<RBTNode *> &nodes);
+
+		void RebuildFilter();
+		void FilterAddTree(const RBTNode *n);
+		void FilterAdd(int data);
+		bool FilterMayContain(int data) const;
+
+		static void MeasureNodes(const RBTNode *n, const RBTNode *&previous, size_t &pageJumps, RBTMemoryUsage &usage);
+		static void UpdateAggregate(RBTNode *n);
+#ifdef RBT_AUGMENT
+		static RBT_AUGMENT::Value AggregateOf(const RBTNode *n);
+		RBT_AUGMENT::Value TreeAggregate(int low, int high) const;
+#endif
+#ifdef RBT_MERKLE
+		void DiffRanges(const RedBlackTree &other, long long low, long long high, vector<pair<int, int>> &ranges) const;
+#endif
+
+		// walks the tree and the write buffer together in key order
+		struct InOrderCursor {
+			const RBTNode *node;
+			vector<int> buffer;   // sorted copy of the write buffer
+			size_t bufferPos;
+			InOrderCursor(const RedBlackTree &rbt);
+			bool Next(int &key);
+		};
+		static bool SameShape(const RBTNode *a, const RBTNode *b);
+
+		static size_t CountNodes(const RBTNode *n);
+		static int *ExportSubtree(const RBTNode *n, int *out);
+		static void SplitForExport(const RBTNode *n, int depth, vector<const RBTNode *> &pieces, vector<bool> &whole);
+		static RBTNode *CompactCopy(const RBTNode *n, RBTNode *parent, RBTNode *block, size_t &next);
+
 
 		RBTNode *Get(int data) const;
 
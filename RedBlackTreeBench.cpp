@@ -0,0 +1,310 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdio>
+#include <cassert>
+#include <thread>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "RedBlackTree.h"
+
+/**
+ *
+ * Rough throughput numbers for the optional features of RedBlackTree.
+ * Build with "make -f MakeFile bench" (optimized, unlike the test builds)
+ * and run from a directory on a local filesystem, the log benchmark syncs
+ * to disk.
+ *
+**/
+
+using namespace std;
+using namespace std::chrono;
+
+static vector<int> RandomKeys(size_t count, unsigned seed){
+	mt19937 gen(seed);
+	vector<int> keys(count);
+	for (size_t i=0; i<count; i++){
+		keys[i]=(int)gen();
+	}
+	return keys;
+}
+
+static double SecondsSince(steady_clock::time_point start){
+	return duration<double>(steady_clock::now()-start).count();
+}
+
+void BenchLogInsert(){
+	cout << "Insert throughput with the write-ahead log" << endl;
+	const size_t count=200000;
+	vector<int> keys=RandomKeys(count, 1);
+	const string logPath="rbt_bench.log";
+
+	auto start=steady_clock::now();
+	{
+		RedBlackTree rbt = RedBlackTree();
+		for (int key : keys){
+			rbt.Insert(key);
+		}
+	}
+	cout << "\tno log:        " << count/SecondsSince(start) << " inserts/s" << endl;
+
+	size_t groupSizes[]={16, 256, 4096, 65536};
+	for (size_t groupSize : groupSizes){
+		remove(logPath.c_str());
+		start=steady_clock::now();
+		{
+			RedBlackTree rbt = RedBlackTree();
+			rbt.EnableLog(logPath, groupSize);
+			for (int key : keys){
+				rbt.Insert(key);
+			}
+		}
+		cout << "\tgroup " << groupSize << ":\t" << count/SecondsSince(start) << " inserts/s" << endl;
+	}
+	remove(logPath.c_str());
+	cout << endl;
+}
+
+void BenchWriteBuffer(){
+	cout << "Sustained inserts and lookups with the write buffer" << endl;
+	const size_t count=2000000;
+	const size_t lookups=1000000;
+	vector<int> keys=RandomKeys(count, 2);
+	vector<int> probes=RandomKeys(lookups, 3);
+	for (size_t i=0; i<lookups; i+=2){
+		probes[i]=keys[(i*7919)%count];   // half of the lookups hit
+	}
+
+	size_t thresholds[]={0, 1024, 16384};
+	for (size_t threshold : thresholds){
+		RedBlackTree rbt = RedBlackTree();
+		if (threshold>0){
+			rbt.EnableWriteBuffer(threshold);
+		}
+		auto start=steady_clock::now();
+		for (int key : keys){
+			rbt.Insert(key);
+		}
+		double insertSeconds=SecondsSince(start);
+
+		for (size_t i=0; i<threshold/2; i++){
+			rbt.Insert(keys[i]);   // leave the buffer half full for the lookups
+		}
+		size_t found=0;
+		start=steady_clock::now();
+		for (int key : probes){
+			found+=rbt.Contains(key);
+		}
+		double lookupSeconds=SecondsSince(start);
+		cout << "\tthreshold " << threshold << ":\t" << count/insertSeconds << " inserts/s, "
+			<< lookupSeconds*1e9/lookups << " ns/Contains (" << found << " found)" << endl;
+	}
+	cout << endl;
+}
+
+void BenchFilter(){
+	cout << "Contains with and without the membership filter" << endl;
+	const size_t count=1000000;
+	const size_t lookups=2000000;
+	vector<int> keys=RandomKeys(count, 4);
+	RedBlackTree plain = RedBlackTree();
+	RedBlackTree filtered = RedBlackTree();
+	filtered.EnableFilter(10);
+	for (int key : keys){
+		plain.Insert(key);
+		filtered.Insert(key);
+	}
+	cout << "\tfilter memory " << filtered.FilterMemoryUsage() << " bytes ("
+		<< filtered.FilterMemoryUsage()*8.0/count << " bits/key), estimated false positive rate "
+		<< filtered.FilterFalsePositiveRate() << endl;
+
+	vector<int> misses=RandomKeys(lookups, 5);   // 32 bit random keys, practically all misses
+
+	double hitRatios[]={0.01, 0.10, 0.90};
+	for (double hitRatio : hitRatios){
+		vector<int> probes=misses;
+		mt19937 gen(6);
+		for (size_t i=0; i<lookups; i++){
+			if (gen()%1000<hitRatio*1000){
+				probes[i]=keys[gen()%count];
+			}
+		}
+		size_t found=0;
+		auto start=steady_clock::now();
+		for (int key : probes){
+			found+=plain.Contains(key);
+		}
+		double plainNs=SecondsSince(start)*1e9/lookups;
+		start=steady_clock::now();
+		for (int key : probes){
+			found-=filtered.Contains(key);
+		}
+		double filteredNs=SecondsSince(start)*1e9/lookups;
+		assert(found==0);
+		cout << "\t" << hitRatio*100 << "% hits:\t" << plainNs << " ns plain, " << filteredNs << " ns filtered" << endl;
+	}
+	cout << endl;
+}
+
+void BenchCompact(){
+	cout << "Scans and lookups before and after Compact" << endl;
+	const size_t count=2000000;
+	const size_t lookups=1000000;
+	vector<int> keys=RandomKeys(count, 7);
+	RedBlackTree rbt = RedBlackTree();
+	for (int key : keys){
+		rbt.Insert(key);
+	}
+	vector<int> probes=RandomKeys(lookups, 8);
+	for (size_t i=0; i<lookups; i+=2){
+		probes[i]=keys[(i*7919)%count];
+	}
+
+	for (int round=0; round<2; round++){
+		auto start=steady_clock::now();
+		RBTMemoryUsage usage=rbt.MemoryUsage();   // an in-order walk over every node
+		double scanSeconds=SecondsSince(start);
+		size_t found=0;
+		start=steady_clock::now();
+		for (int key : probes){
+			found+=rbt.Contains(key);
+		}
+		double lookupNs=SecondsSince(start)*1e9/lookups;
+		cout << "\t" << (round==0 ? "before" : "after ") << ": scan " << scanSeconds*1e3 << " ms, "
+			<< lookupNs << " ns/Contains, fragmentation " << usage.fragmentation
+			<< ", allocator overhead " << usage.allocatorOverhead << " bytes (" << found << " found)" << endl;
+		if (round==0){
+			start=steady_clock::now();
+			rbt.Compact();
+			cout << "\tCompact took " << SecondsSince(start)*1e3 << " ms" << endl;
+		}
+	}
+	cout << endl;
+}
+
+static long PeakRssMB(){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss/1024;   // ru_maxrss is in KB on Linux
+}
+
+void BenchKeyFileBuild(){
+	cout << "Building from key files (run first so peak RSS isn't from other benchmarks)" << endl;
+	const size_t count=16000000;
+	const size_t budget=8<<20;
+	const string binaryPath="rbt_bench_keys.bin";
+	const string textPath="rbt_bench_keys.txt";
+	const string sortedPath="rbt_bench_keys.sorted";
+	{
+		vector<int> keys=RandomKeys(count, 9);
+		FILE *binary=fopen(binaryPath.c_str(), "wb");
+		fwrite(keys.data(), sizeof(int), keys.size(), binary);
+		fclose(binary);
+		FILE *text=fopen(textPath.c_str(), "w");
+		for (int key : keys){
+			fprintf(text, "%d\n", key);
+		}
+		fclose(text);
+	}
+	cout << "\tpeak RSS after writing the input files: " << PeakRssMB() << " MB" << endl;
+	double binaryGB=count*sizeof(int)/1e9;
+
+	auto start=steady_clock::now();
+	RedBlackTree::SortKeyFile(binaryPath, false, sortedPath, budget);
+	double seconds=SecondsSince(start);
+	cout << "\tsort binary, " << (budget>>20) << " MB budget: " << binaryGB/seconds << " GB/s" << endl;
+
+	struct stat info;
+	stat(textPath.c_str(), &info);
+	start=steady_clock::now();
+	RedBlackTree::SortKeyFile(textPath, true, sortedPath, budget);
+	seconds=SecondsSince(start);
+	cout << "\tsort text, " << (budget>>20) << " MB budget:   " << info.st_size/1e9/seconds << " GB/s of text" << endl;
+
+	start=steady_clock::now();
+	{
+		RedBlackTree rbt = RedBlackTree();
+		rbt.LoadSortedFile(sortedPath);
+		seconds=SecondsSince(start);
+		cout << "\tload sorted file into the tree: " << binaryGB/seconds << " GB/s, peak RSS "
+			<< PeakRssMB() << " MB for " << count << " nodes" << endl;
+	}
+
+	start=steady_clock::now();
+	{
+		RedBlackTree rbt = RedBlackTree();
+		for (int i=0; i<(int)count; i++){
+			rbt.Insert((int)(i*2654435761u));   // the same number of keys through Insert, for comparison
+		}
+		seconds=SecondsSince(start);
+		cout << "\tsame count through Insert: " << binaryGB/seconds << " GB/s" << endl;
+	}
+	remove(binaryPath.c_str());
+	remove(textPath.c_str());
+	remove(sortedPath.c_str());
+	cout << endl;
+}
+
+void BenchExportSorted(){
+	cout << "Exporting keys as a sorted array" << endl;
+	size_t counts[]={1000000, 10000000};
+	for (size_t count : counts){
+		vector<int> keys=RandomKeys(count, 10);
+		RedBlackTree rbt = RedBlackTree();
+		for (int key : keys){
+			rbt.Insert(key);
+		}
+		vector<int> out(count);
+		auto start=steady_clock::now();
+		rbt.ExportSorted(out.data());
+		double seconds=SecondsSince(start);
+		cout << "\t" << count << " keys, ExportSorted: " << seconds*1e3 << " ms, "
+			<< count*sizeof(int)/1e9/seconds << " GB/s written (" << thread::hardware_concurrency() << " cores)" << endl;
+
+		vector<int> chunk(1<<14);
+		size_t total=0;
+		start=steady_clock::now();
+		rbt.ExportSorted(chunk.data(), chunk.size(), [&](const int *, size_t n){ total+=n; });
+		seconds=SecondsSince(start);
+		cout << "\t" << count << " keys, chunked:      " << seconds*1e3 << " ms" << endl;
+
+		RedBlackTree compacted = RedBlackTree(rbt);
+		compacted.Compact();   // nodes in key order, so the walk streams through memory
+		start=steady_clock::now();
+		compacted.ExportSorted(out.data());
+		seconds=SecondsSince(start);
+		cout << "\t" << count << " keys, ExportSorted after Compact: " << seconds*1e3 << " ms, "
+			<< count*sizeof(int)/1e9/seconds << " GB/s written" << endl;
+
+		if (count<=1000000){   // the string path gets too slow beyond this
+			start=steady_clock::now();
+			string infix=rbt.ToInfixString();
+			size_t parsed=0;
+			const char *p=infix.c_str();
+			while (*p){   // what consumers do today: parse " B12  R15 " back into ints
+				while (*p==' ' || *p=='R' || *p=='B'){
+					p++;
+				}
+				if (*p){
+					out[parsed++]=(int)strtol(p, (char **)&p, 10);
+				}
+			}
+			seconds=SecondsSince(start);
+			cout << "\t" << count << " keys, ToInfixString + parse: " << seconds*1e3 << " ms" << endl;
+		}
+	}
+	cout << endl;
+}
+
+
+int main(){
+	BenchKeyFileBuild();
+	BenchLogInsert();
+	BenchWriteBuffer();
+	BenchFilter();
+	BenchCompact();
+	BenchExportSorted();
+	return 0;
+}
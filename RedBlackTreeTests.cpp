@@ -2,10 +2,49 @@
 #include <iostream>
 #include <cassert>
 #include <random>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+#include <csignal>
+#include <unistd.h>
+#include <sys/resource.h>
 #include "RedBlackTree.h"
+#include "StaticRedBlackTree.h"
 
 using namespace std;
 
+// Rebuilds the tree from its prefix string and checks the red-black rules:
+// keys in order, black root, no red node with a red child, same black height everywhere.
+static int CheckRBT(const vector<pair<char, int>> &nodes, size_t &pos, long long low, long long high, char parentColor){
+	if (pos==nodes.size() || nodes[pos].second<low || nodes[pos].second>high){
+		return 1;   // an empty subtree, null leaves count as black
+	}
+	char color=nodes[pos].first;
+	int data=nodes[pos].second;
+	pos++;
+	assert(!(color=='R' && parentColor=='R'));
+	int leftHeight=CheckRBT(nodes, pos, low, (long long)data-1, color);
+	int rightHeight=CheckRBT(nodes, pos, (long long)data+1, high, color);
+	assert(leftHeight==rightHeight);
+	return leftHeight+(color=='B' ? 1 : 0);
+}
+
+template <typename Tree>
+static bool IsValidRBT(const Tree &rbt){
+	vector<pair<char, int>> nodes;
+	stringstream ss(rbt.ToPrefixString());
+	string token;
+	while (ss >> token){
+		nodes.push_back(make_pair(token[0], stoi(token.substr(1))));
+	}
+	if (!nodes.empty() && nodes[0].first!='B'){
+		return false;
+	}
+	size_t pos=0;
+	CheckRBT(nodes, pos, LLONG_MIN, LLONG_MAX, 'B');
+	return pos==nodes.size();
+}
+
 void TestSimpleConstructor(){
 	cout << "Testing Simple Constructor... " << endl;
 	RedBlackTree rbt = RedBlackTree();
@@ -282,8 +321,11 @@ void TestCopyConstructor(){
 
 	assert(rbt2.ToPrefixString() == rbt1.ToPrefixString());
 
+	assert(rbt2 == rbt1);
+
 	rbt1.Insert(200);
 	assert(rbt2.ToPrefixString() != rbt1.ToPrefixString());
+	assert(rbt2 != rbt1);
 
 	cout << "PASSED!" << endl << endl;
 }
@@ -386,6 +428,662 @@ void TestGetMinimumMaximum(){
 
 
 
+static string ReadWholeFile(const string &path){
+	string contents;
+	FILE *file=fopen(path.c_str(), "rb");
+	char buf[4096];
+	size_t got;
+	while ((got=fread(buf, 1, sizeof(buf), file))>0){
+		contents.append(buf, got);
+	}
+	fclose(file);
+	return contents;
+}
+
+static void WriteWholeFile(const string &path, const string &contents){
+	FILE *file=fopen(path.c_str(), "wb");
+	fwrite(contents.data(), 1, contents.size(), file);
+	fclose(file);
+}
+
+void TestLogRecovery(){
+	cout << "Testing Log And Recovery..." << endl;
+	const string checkpointPath="rbt_test.ckpt";
+	const string logPath="rbt_test.log";
+	remove(checkpointPath.c_str());
+	remove(logPath.c_str());
+
+	RedBlackTree *rbt = new RedBlackTree();
+	rbt->EnableLog(logPath, 4);
+	for (int i=0; i<100; i++){
+		rbt->Insert((i*37)%101);
+	}
+	rbt->Checkpoint(checkpointPath);
+	for (int i=100; i<110; i++){
+		rbt->Insert(i*3);   // these only live in the log
+	}
+	assert(IsValidRBT(*rbt));
+	delete rbt;   // destructor commits the last partial group
+
+	RedBlackTree recovered = RedBlackTree();
+	recovered.Recover(checkpointPath, logPath);
+	assert(recovered.Size()==110);
+	assert(IsValidRBT(recovered));
+	for (int i=0; i<100; i++){
+		assert(recovered.Contains((i*37)%101));
+	}
+	for (int i=100; i<110; i++){
+		assert(recovered.Contains(i*3));
+	}
+	assert(recovered.GetMin()==0);
+	assert(recovered.GetMax()==327);
+
+	// nothing on disk at all recovers to an empty tree
+	remove(checkpointPath.c_str());
+	remove(logPath.c_str());
+	RedBlackTree empty = RedBlackTree();
+	empty.Recover(checkpointPath, logPath);
+	assert(empty.Size()==0);
+
+	// crash after the checkpoint is renamed but before the log is truncated
+	remove(checkpointPath.c_str());
+	remove(logPath.c_str());
+	rbt = new RedBlackTree();
+	rbt->EnableLog(logPath, 1);
+	rbt->Insert(1);
+	rbt->Insert(2);
+	string untruncated=ReadWholeFile(logPath);
+	rbt->Checkpoint(checkpointPath);
+	rbt->Insert(3);   // logged after the checkpoint, has to be replayed
+	untruncated+=ReadWholeFile(logPath);
+	delete rbt;
+	WriteWholeFile(logPath, untruncated);
+	RedBlackTree notTwice = RedBlackTree();
+	notTwice.Recover(checkpointPath, logPath);
+	assert(notTwice.Size()==3);
+	assert(notTwice.Contains(3));
+	remove(checkpointPath.c_str());
+	remove(logPath.c_str());
+
+	// a torn last record is dropped, and logging afterwards still lines up
+	rbt = new RedBlackTree();
+	rbt->EnableLog(logPath, 1);
+	rbt->Insert(10);
+	rbt->Insert(20);
+	delete rbt;
+	WriteWholeFile(logPath, ReadWholeFile(logPath)+string(3, '\x01'));
+	RedBlackTree torn = RedBlackTree();
+	torn.Recover(checkpointPath, logPath);
+	assert(torn.Size()==2);
+	torn.EnableLog(logPath, 1);
+	torn.Insert(30);
+	torn.Insert(40);
+	RedBlackTree afterTorn = RedBlackTree();
+	afterTorn.Recover(checkpointPath, logPath);
+	assert(afterTorn.Size()==4);
+	assert(afterTorn.Contains(10) && afterTorn.Contains(40));
+
+	// a group written twice is only replayed once
+	WriteWholeFile(logPath, ReadWholeFile(logPath)+ReadWholeFile(logPath));
+	RedBlackTree repeated = RedBlackTree();
+	repeated.Recover(checkpointPath, logPath);
+	assert(repeated.Size()==4);
+	remove(logPath.c_str());
+
+	// a failed commit stops the log for good instead of retrying the group
+	if (access("/dev/full", W_OK)==0){
+		RedBlackTree full = RedBlackTree();
+		full.EnableLog("/dev/full", 1);
+		for (int attempt=0; attempt<2; attempt++){
+			try{
+				full.Insert(attempt);
+				assert(false);
+			}
+			catch (const runtime_error& e){
+			}
+		}
+		assert(full.Size()==0);   // neither insert was applied
+		try{
+			full.FlushLog();
+			assert(false);
+		}
+		catch (const runtime_error& e){
+		}
+	}
+
+	// a snapshot that can't be written leaves no temp file behind
+	struct rlimit fileSize;
+	getrlimit(RLIMIT_FSIZE, &fileSize);
+	struct rlimit tiny=fileSize;
+	tiny.rlim_cur=64;   // room for the header but not the keys, writes fail with EFBIG
+	signal(SIGXFSZ, SIG_IGN);
+	setrlimit(RLIMIT_FSIZE, &tiny);
+	try{
+		recovered.Checkpoint(checkpointPath);
+		assert(false);
+	}
+	catch (const runtime_error& e){
+	}
+	setrlimit(RLIMIT_FSIZE, &fileSize);
+	signal(SIGXFSZ, SIG_DFL);
+	assert(access((checkpointPath+".tmp").c_str(), F_OK)!=0);
+	assert(access(checkpointPath.c_str(), F_OK)!=0);
+
+	try{
+		recovered.Recover(checkpointPath, logPath);
+		assert(false);
+	}
+	catch (const invalid_argument& e){
+	}
+
+	cout << "PASSED!" << endl << endl;
+}
+
+void TestWriteBuffer(){
+	cout << "Testing Write Buffer..." << endl;
+
+	RedBlackTree rbt = RedBlackTree();
+	rbt.EnableWriteBuffer(8);
+	rbt.Insert(50);
+	rbt.Insert(20);
+	rbt.Insert(80);
+	assert(rbt.ToInfixString() == "");   // nothing merged yet
+	assert(rbt.Size()==3);
+	assert(rbt.Contains(20));
+	assert(rbt.Contains(30) == false);
+	assert(rbt.GetMin()==20);
+	assert(rbt.GetMax()==80);
+
+	RedBlackTree copy = RedBlackTree(rbt);
+	assert(copy.Contains(80));
+
+	mt19937 gen(7);
+	vector<int> inserted={50, 20, 80};
+	for (int i=0; i<500; i++){
+		int key=(int)(gen()%100000)+100;
+		if (find(inserted.begin(), inserted.end(), key)!=inserted.end()){
+			continue;
+		}
+		rbt.Insert(key);
+		inserted.push_back(key);
+		assert(IsValidRBT(rbt));   // merges must leave a valid tree behind
+	}
+	for (int key : inserted){
+		assert(rbt.Contains(key));
+	}
+	assert(rbt.Size()==inserted.size());
+	rbt.Insert(1);   // new minimum, sits in the buffer
+	assert(rbt.GetMin()==1);
+	assert(rbt.GetMax()==*max_element(inserted.begin(), inserted.end()));
+
+	rbt.FlushWriteBuffer();
+	assert(IsValidRBT(rbt));
+	assert(rbt.Contains(1));
+	assert(rbt.Size()==inserted.size()+1);
+
+	RedBlackTree fingered = RedBlackTree();   // batches small next to the tree take the finger path
+	RedBlackTree plain = RedBlackTree();
+	for (int i=0; i<2000; i++){
+		fingered.Insert(i*3);
+		plain.Insert(i*3);
+	}
+	fingered.EnableWriteBuffer(64);
+	vector<int> between;
+	for (int i=-200; i<2200; i++){
+		between.push_back(i*3+1);   // between the tree's keys, and below and above them
+	}
+	shuffle(between.begin(), between.end(), gen);
+	for (int key : between){
+		fingered.Insert(key);
+		plain.Insert(key);
+		assert(fingered.SameKeys(plain));   // compares through a sorted copy of the buffer
+	}
+	fingered.FlushWriteBuffer();
+	assert(IsValidRBT(fingered));
+	assert(fingered.SameKeys(plain));
+
+	cout << "PASSED!" << endl << endl;
+}
+
+void TestFilter(){
+	cout << "Testing Membership Filter..." << endl;
+
+	RedBlackTree rbt = RedBlackTree();
+	rbt.Insert(5);
+	rbt.EnableFilter(10);
+	assert(rbt.Contains(5));   // keys from before the filter existed are in it
+	assert(rbt.Contains(6) == false);
+	size_t smallMemory=rbt.FilterMemoryUsage();
+	assert(smallMemory>0);
+
+	for (int i=0; i<5000; i++){
+		rbt.Insert(i*2+10);   // grows past the first capacity and rebuilds
+	}
+	assert(rbt.FilterMemoryUsage()>smallMemory);
+	for (int i=0; i<5000; i++){
+		assert(rbt.Contains(i*2+10));   // never a false negative
+		assert(rbt.Contains(i*2+11) == false);
+	}
+	double rate=rbt.FilterFalsePositiveRate();
+	assert(rate>0 && rate<0.05);
+
+	RedBlackTree buffered = RedBlackTree();
+	buffered.EnableWriteBuffer(16);
+	buffered.EnableFilter(8);
+	for (int i=0; i<100; i++){
+		buffered.Insert(i*3);
+		assert(buffered.Contains(i*3));   // buffered keys are in the filter too
+	}
+
+	cout << "PASSED!" << endl << endl;
+}
+
+void TestCompact(){
+	cout << "Testing Memory Usage And Compact..." << endl;
+
+	RedBlackTree rbt = RedBlackTree();
+	mt19937 gen(11);
+	for (int i=0; i<1000; i++){
+		rbt.Insert((int)(gen()%1000000));
+	}
+	RBTMemoryUsage before=rbt.MemoryUsage();
+	assert(before.nodeCount==1000);
+	assert(before.nodeBytes==1000*sizeof(RBTNode));
+	assert(before.scatteredNodes==1000);
+	assert(before.allocatorOverhead>0);
+
+	string shape=rbt.ToPrefixString();
+	rbt.Compact();
+	assert(rbt.ToPrefixString()==shape);   // same tree, different addresses
+	assert(IsValidRBT(rbt));
+	RBTMemoryUsage after=rbt.MemoryUsage();
+	assert(after.nodeCount==1000);
+	assert(after.scatteredNodes==0);
+	assert(after.allocatorOverhead==0);
+	assert(after.fragmentation<before.fragmentation);
+
+	rbt.Insert(-5);   // a regular node next to compacted ones
+	assert(rbt.Contains(-5));
+	assert(IsValidRBT(rbt));
+	assert(rbt.MemoryUsage().scatteredNodes==1);
+	rbt.Compact();   // compacting again releases the old block
+	assert(rbt.MemoryUsage().scatteredNodes==0);
+	assert(rbt.GetMin()==-5);
+
+	RedBlackTree copy = RedBlackTree(rbt);
+	assert(copy.ToPrefixString()==rbt.ToPrefixString());
+
+	RedBlackTree buffered = RedBlackTree();
+	for (int i=0; i<100; i++){
+		buffered.Insert(i*2);
+	}
+	buffered.Compact();
+	buffered.EnableWriteBuffer(19);
+	for (int i=0; i<20; i++){
+		buffered.Insert(i*10+1);   // the 20th flushes, big enough to rebuild
+	}
+	RBTMemoryUsage rebuilt=buffered.MemoryUsage();   // the rebuild relinks the compacted nodes, the block stays
+	assert(rebuilt.nodeCount==120);
+	assert(rebuilt.scatteredNodes==20);
+	assert(IsValidRBT(buffered));
+	buffered.Compact();
+	assert(buffered.MemoryUsage().scatteredNodes==0);
+	assert(buffered.Contains(191) && buffered.Contains(198));
+
+	cout << "PASSED!" << endl << endl;
+}
+
+#ifdef RBT_AUGMENT
+static RBT_AUGMENT::Value BruteForceAggregate(const vector<int> &keys, int low, int high){
+	vector<int> sorted=keys;
+	sort(sorted.begin(), sorted.end());
+	RBT_AUGMENT::Value result=RBT_AUGMENT::Identity();
+	for (int key : sorted){
+		if (key>=low && key<=high){
+			result=RBT_AUGMENT::Combine(result, RBT_AUGMENT::Lift(key));
+		}
+	}
+	return result;
+}
+
+void TestRangeAggregate(){
+	cout << "Testing Range Aggregate..." << endl;
+
+	RedBlackTree empty = RedBlackTree();
+	assert(empty.RangeAggregate(INT_MIN, INT_MAX)==RBT_AUGMENT::Identity());
+
+	mt19937 gen(13);
+	for (int trial=0; trial<20; trial++){
+		RedBlackTree rbt = RedBlackTree();
+		if (trial%4==1){
+			rbt.EnableWriteBuffer(8);   // some keys still buffered during the queries
+		}
+		vector<int> keys;
+		int count=1+(int)(gen()%300);
+		for (int i=0; i<count; i++){
+			int key=(int)(gen()%2000)-1000;   // small range, so duplicates show up
+			rbt.Insert(key);
+			keys.push_back(key);
+		}
+		if (trial%4==2){
+			rbt.Compact();
+		}
+		RedBlackTree copy = RedBlackTree(rbt);
+		for (int q=0; q<100; q++){
+			int low=(int)(gen()%2400)-1200;
+			int high=low+(int)(gen()%800);
+			assert(rbt.RangeAggregate(low, high)==BruteForceAggregate(keys, low, high));
+			assert(copy.RangeAggregate(low, high)==BruteForceAggregate(keys, low, high));
+		}
+		assert(rbt.RangeAggregate(INT_MIN, INT_MAX)==BruteForceAggregate(keys, INT_MIN, INT_MAX));
+		assert(rbt.RangeAggregate(5, 4)==RBT_AUGMENT::Identity());
+	}
+
+	cout << "PASSED!" << endl << endl;
+}
+#endif
+
+static constexpr auto httpCodes = MakeStaticRedBlackTree({404, 200, 500, 301, 302, 201, 204, 418, 503, 400});
+static_assert(httpCodes.Contains(418), "built and searched by the compiler");
+static_assert(!httpCodes.Contains(405), "");
+static_assert(httpCodes.GetMin()==200 && httpCodes.GetMax()==503, "");
+
+void TestStaticTree(){
+	cout << "Testing Static Tree..." << endl;
+
+	assert(httpCodes.Size()==10);
+	assert(IsValidRBT(httpCodes));
+
+	static constexpr auto single = MakeStaticRedBlackTree({7});
+	assert(single.ToPrefixString() == " B7 ");
+	assert(single.Contains(7));
+	assert(single.Contains(8) == false);
+
+	static constexpr auto three = MakeStaticRedBlackTree({30, 15, 45});
+	assert(three.ToPrefixString() == " B30  R15  R45 ");
+
+	// a bigger table is still valid and answers the same as the runtime tree
+	static constexpr int keys[64]={
+		 5, 88, 13, 42,  7, 99, 61, 20, 34, 77, 11, 56,  2, 93, 48, 70,
+		39, 16, 85, 27, 64,  9, 51, 74, 30, 97, 18, 45, 81,  3, 59, 24,
+		90, 36, 67, 14, 53,  1, 79, 41, 22, 95, 62, 33,  8, 71, 47, 86,
+		19, 58, 26, 92, 10, 65, 38, 83,  4, 50, 29, 75, 17, 98, 44, 68};
+	static constexpr auto all = MakeStaticRedBlackTree(keys);
+	assert(IsValidRBT(all));
+	RedBlackTree runtime = RedBlackTree();
+	for (int key : keys){
+		runtime.Insert(key);
+	}
+	for (int probe=-1; probe<=100; probe++){
+		assert(all.Contains(probe)==runtime.Contains(probe));
+	}
+	assert(all.GetMin()==runtime.GetMin());
+	assert(all.GetMax()==runtime.GetMax());
+
+	cout << "PASSED!" << endl << endl;
+}
+
+void TestKeyFileBuild(){
+	cout << "Testing Build From Key Files..." << endl;
+	const string binaryPath="rbt_test_keys.bin";
+	const string textPath="rbt_test_keys.txt";
+	const string sortedPath="rbt_test_keys.sorted";
+
+	vector<int> keys;
+	for (int i=0; i<60000; i++){
+		keys.push_back(i*7-200000);   // distinct, some negative
+	}
+	shuffle(keys.begin(), keys.end(), mt19937(17));
+	FILE *binary=fopen(binaryPath.c_str(), "wb");
+	fwrite(keys.data(), sizeof(int), keys.size(), binary);
+	fclose(binary);
+	FILE *text=fopen(textPath.c_str(), "w");
+	for (size_t i=0; i<keys.size(); i++){
+		fprintf(text, i%3==0 ? "%d\n" : "%d, ", keys[i]);   // long enough that numbers straddle read chunks
+	}
+	fclose(text);
+	vector<int> sorted=keys;
+	sort(sorted.begin(), sorted.end());
+
+	// a tiny budget forces several runs and a merge
+	RedBlackTree::SortKeyFile(binaryPath, false, sortedPath, 1);
+	vector<int> onDisk(keys.size()+1);
+	FILE *result=fopen(sortedPath.c_str(), "rb");
+	assert(fread(onDisk.data(), sizeof(int), onDisk.size(), result)==keys.size());
+	fclose(result);
+	onDisk.resize(keys.size());
+	assert(onDisk==sorted);
+
+	RedBlackTree fromBinary = RedBlackTree();
+	fromBinary.LoadSortedFile(sortedPath);
+	assert(fromBinary.Size()==keys.size());
+	assert(IsValidRBT(fromBinary));
+	assert(fromBinary.GetMin()==sorted.front());
+	assert(fromBinary.GetMax()==sorted.back());
+
+	RedBlackTree fromText = RedBlackTree();
+	fromText.BuildFromKeyFile(textPath, true, sortedPath, 1<<20);
+	assert(fromText.ToPrefixString()==fromBinary.ToPrefixString());
+	for (int i=0; i<1000; i++){
+		assert(fromText.Contains(keys[i]));
+		assert(fromText.Contains(keys[i]+1) == false);
+	}
+
+	try{
+		fromText.LoadSortedFile(sortedPath);
+		assert(false);
+	}
+	catch (const invalid_argument& e){
+	}
+
+	// stray bytes after the last key are rejected before any node is built,
+	// whether or not they fall in the last read chunk
+	size_t ragged[]={65536, 65537};
+	for (size_t count : ragged){
+		vector<int> ascending(count);
+		for (size_t i=0; i<count; i++){
+			ascending[i]=(int)i;
+		}
+		WriteWholeFile(sortedPath, string((const char *)ascending.data(), count*sizeof(int))+"xx");
+		RedBlackTree partial = RedBlackTree();
+		try{
+			partial.LoadSortedFile(sortedPath);
+			assert(false);
+		}
+		catch (const runtime_error& e){
+		}
+		assert(partial.Size()==0);
+	}
+	int unsortedKeys[]={5, 1, 3};
+	WriteWholeFile(sortedPath, string((const char *)unsortedKeys, sizeof(unsortedKeys)));
+	RedBlackTree unsorted = RedBlackTree();
+	try{
+		unsorted.LoadSortedFile(sortedPath);
+		assert(false);
+	}
+	catch (const runtime_error& e){
+	}
+	assert(unsorted.Size()==0);
+
+	// '-' always starts a new number, and keys must fit in an int
+	WriteWholeFile(textPath, "5-3 -2147483648,2147483647");
+	RedBlackTree edges = RedBlackTree();
+	edges.BuildFromKeyFile(textPath, true, sortedPath, 1<<20);
+	assert(edges.Size()==4);
+	assert(edges.Contains(5) && edges.Contains(-3));
+	assert(edges.GetMin()==INT_MIN && edges.GetMax()==INT_MAX);
+	const char *outOfRange[]={"1 2147483648", "-2147483649", "123456789012345678901234567890"};
+	for (const char *contents : outOfRange){
+		WriteWholeFile(textPath, contents);
+		try{
+			RedBlackTree::SortKeyFile(textPath, true, sortedPath, 1<<20);
+			assert(false);
+		}
+		catch (const runtime_error& e){
+		}
+	}
+
+	// more runs than open files allowed takes several merge passes
+	vector<int> many(2000000);
+	for (size_t i=0; i<many.size(); i++){
+		many[i]=(int)(i*2654435761u);
+	}
+	binary=fopen(binaryPath.c_str(), "wb");
+	fwrite(many.data(), sizeof(int), many.size(), binary);
+	fclose(binary);
+	struct rlimit files;
+	getrlimit(RLIMIT_NOFILE, &files);
+	struct rlimit lowered=files;
+	lowered.rlim_cur=28;   // leaves a fan-in of 12 for 16 runs
+	setrlimit(RLIMIT_NOFILE, &lowered);
+	RedBlackTree::SortKeyFile(binaryPath, false, sortedPath, 1<<20);
+	setrlimit(RLIMIT_NOFILE, &files);
+	onDisk.resize(many.size()+1);
+	result=fopen(sortedPath.c_str(), "rb");
+	assert(fread(onDisk.data(), sizeof(int), onDisk.size(), result)==many.size());
+	fclose(result);
+	onDisk.resize(many.size());
+	sort(many.begin(), many.end());
+	assert(onDisk==many);
+	for (int run=0; run<40; run++){
+		assert(access((sortedPath+".run"+to_string(run)).c_str(), F_OK)!=0);   // no runs left behind
+	}
+
+	remove(binaryPath.c_str());
+	remove(textPath.c_str());
+	remove(sortedPath.c_str());
+	cout << "PASSED!" << endl << endl;
+}
+
+void TestEquality(){
+	cout << "Testing Equality..." << endl;
+
+	RedBlackTree empty1 = RedBlackTree();
+	RedBlackTree empty2 = RedBlackTree();
+	assert(empty1 == empty2);
+	assert(empty1.SameKeys(empty2));
+
+	// same keys in a different order give a different shape
+	RedBlackTree ascending = RedBlackTree();
+	RedBlackTree shuffled = RedBlackTree();
+	vector<int> keys;
+	for (int i=0; i<200; i++){
+		keys.push_back(i*5);
+		ascending.Insert(i*5);
+	}
+	shuffle(keys.begin(), keys.end(), mt19937(19));
+	for (int key : keys){
+		shuffled.Insert(key);
+	}
+	assert(ascending != shuffled);
+	assert(ascending.SameKeys(shuffled));
+
+	RedBlackTree copy = RedBlackTree(shuffled);
+	copy.Compact();
+	assert(copy == shuffled);   // addresses don't matter
+
+	RedBlackTree buffered = RedBlackTree();
+	buffered.EnableWriteBuffer(64);
+	for (int key : keys){
+		buffered.Insert(key);
+	}
+	assert(buffered.SameKeys(ascending));   // part of it is still in the buffer
+
+	shuffled.Insert(3);
+	ascending.Insert(4);
+	assert(!ascending.SameKeys(shuffled));   // same size, one key differs
+	assert(!ascending.SameKeys(copy));   // different size
+
+	cout << "PASSED!" << endl << endl;
+}
+
+#ifdef RBT_MERKLE
+void TestDiffRanges(){
+	cout << "Testing Diff Ranges..." << endl;
+
+	RedBlackTree a = RedBlackTree();
+	RedBlackTree b = RedBlackTree();
+	mt19937 gen(23);
+	for (int i=0; i<5000; i++){
+		int key=(int)(gen()%1000000);
+		a.Insert(key);
+		b.Insert(key);
+	}
+	vector<pair<int, int>> ranges;
+	a.DiffRanges(b, ranges);
+	assert(ranges.empty());
+
+	a.Insert(-7);
+	b.Insert(500);
+	b.Insert(501);
+	a.Insert(INT_MAX);
+	a.DiffRanges(b, ranges);
+	assert(ranges.size()==3);
+	assert(ranges[0]==make_pair(-7, -7));
+	assert(ranges[1]==make_pair(500, 501));   // neighbouring keys come back as one range
+	assert(ranges[2]==make_pair(INT_MAX, INT_MAX));
+
+	cout << "PASSED!" << endl << endl;
+}
+#endif
+
+void TestExportSorted(){
+	cout << "Testing Export Sorted..." << endl;
+
+	RedBlackTree empty = RedBlackTree();
+	int nothing[1]={42};
+	empty.ExportSorted(nothing);
+	assert(nothing[0]==42);
+
+	mt19937 gen(29);
+	RedBlackTree rbt = RedBlackTree();
+	vector<int> keys;
+	for (int i=0; i<20000; i++){
+		int key=(int)(gen()%50000)-25000;   // duplicates too
+		rbt.Insert(key);
+		keys.push_back(key);
+	}
+	sort(keys.begin(), keys.end());
+
+	vector<int> out(keys.size());
+	rbt.ExportSorted(out.data());
+	assert(out==keys);
+	unsigned threadCounts[]={2, 3, 8};
+	for (unsigned threads : threadCounts){
+		fill(out.begin(), out.end(), 0);
+		rbt.ExportSorted(out.data(), threads);   // split into pieces even though the tree is small
+		assert(out==keys);
+	}
+
+	vector<int> chunked;
+	int buffer[7];
+	rbt.ExportSorted(buffer, 7, [&](const int *chunk, size_t count){
+		assert(count<=7);
+		chunked.insert(chunked.end(), chunk, chunk+count);
+	});
+	assert(chunked==keys);
+
+	RedBlackTree buffered = RedBlackTree();
+	buffered.EnableWriteBuffer(100);
+	vector<int> some(keys.begin(), keys.begin()+150);
+	shuffle(some.begin(), some.end(), gen);
+	for (int key : some){
+		buffered.Insert(key);   // 101 merged, 49 left in the buffer
+	}
+	sort(some.begin(), some.end());
+	vector<int> merged(some.size());
+	buffered.ExportSorted(merged.data(), 4);
+	assert(merged==some);
+	chunked.clear();
+	buffered.ExportSorted(buffer, 7, [&](const int *chunk, size_t count){
+		chunked.insert(chunked.end(), chunk, chunk+count);
+	});
+	assert(chunked==some);
+
+	cout << "PASSED!" << endl << endl;
+}
+
+
 int main(){
 
 	
@@ -406,6 +1104,21 @@ int main(){
 	TestContains();
 	TestGetMinimumMaximum();
 
+	TestLogRecovery();
+	TestWriteBuffer();
+	TestFilter();
+	TestCompact();
+#ifdef RBT_AUGMENT
+	TestRangeAggregate();
+#endif
+	TestStaticTree();
+	TestKeyFileBuild();
+	TestEquality();
+#ifdef RBT_MERKLE
+	TestDiffRanges();
+#endif
+	TestExportSorted();
+
 	
 	cout << "ALL TESTS PASSED!!" << endl;
 	return 0;
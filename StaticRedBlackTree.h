@@ -0,0 +1,86 @@
+#ifndef STATICREDBLACKTREE_H
+#define STATICREDBLACKTREE_H
+
+#include "RedBlackTree.h"
+
+/*
+A red-black tree over a key set that's known at compile time. The constructor is
+constexpr, so a "static constexpr" table is sorted, balanced and colored by the
+compiler and sits in read-only data, with nothing to build or allocate at startup.
+
+Nodes are stored in sorted order with child indexes, -1 means no child. The shape
+is the same one the runtime tree's balanced builder makes: the middle key is the
+root and the deepest level is red. Lookups go through the same SearchTree loop
+as RedBlackTree::Get.
+
+	static constexpr auto codes = MakeStaticRedBlackTree({200, 301, 404, 500});
+	static_assert(codes.Contains(404), "");
+*/
+
+template <size_t N>
+class StaticRedBlackTree {
+	static_assert(N>0, "StaticRedBlackTree needs at least one key");
+
+	public:
+		constexpr StaticRedBlackTree(const int (&keys)[N]){
+			for (size_t i=0; i<N; i++){   // insertion sort, std::sort isn't constexpr yet
+				int key=keys[i];
+				size_t j=i;
+				while (j>0 && data[j-1]>key){
+					data[j]=data[j-1];
+					j--;
+				}
+				data[j]=key;
+			}
+			int redDepth=0;
+			while ((size_t(2)<<redDepth)<=N){  // floor(log2(N)), the deepest level
+				redDepth++;
+			}
+			root=Build(0, N, 0, redDepth);
+		}
+
+		constexpr bool Contains(int key) const {
+			return SearchTree<int>(root, -1, key,
+				[this](int x){ return data[x]; },
+				[this](int x, bool goLeft){ return goLeft ? left[x] : right[x]; })!=-1;
+		}
+		constexpr size_t Size() const {return N;};
+		constexpr int GetMin() const {return data[0];};
+		constexpr int GetMax() const {return data[N-1];};
+
+		string ToPrefixString() const { return ToPrefixString(root);};
+
+	private:
+		int data[N] = {};
+		unsigned short int color[N] = {};
+		int left[N] = {};
+		int right[N] = {};
+		int root = -1;
+
+		constexpr int Build(size_t first, size_t count, int depth, int redDepth){
+			if (count==0){
+				return -1;
+			}
+			size_t leftCount=(count-1)/2;
+			int n=(int)(first+leftCount);   // sorted position doubles as the node index
+			left[n]=Build(first, leftCount, depth+1, redDepth);
+			right[n]=Build(n+1, count-1-leftCount, depth+1, redDepth);
+			color[n]=(depth==redDepth && depth>0) ? COLOR_RED : COLOR_BLACK;
+			return n;
+		}
+
+		string ToPrefixString(int n) const {
+			if (n==-1){
+				return "";
+			}
+			string node=" "+string(color[n]==COLOR_RED ? "R" : "B")+to_string(data[n])+" ";
+			return node+ToPrefixString(left[n])+ToPrefixString(right[n]);
+		}
+};
+
+template <size_t N>
+constexpr StaticRedBlackTree<N> MakeStaticRedBlackTree(const int (&keys)[N]){
+	return StaticRedBlackTree<N>(keys);
+}
+
+#endif